@@ -11,8 +11,11 @@
  * and put the large values elsewhere in memory so that more keys can be
  * put into cache.
  */
-//TODO: SmallMap.hh - everything in 1 vector
-//TODO: HugeMap.hh - values are so big/so disinteresting that we store in list so waste no time with reallocating vals
+//See SmallMap.hh for values small enough to keep next to the keys, and
+//HugeMap.hh for values so big that we never want to move them at all, and
+//PrefixMap.hh for string keys that mostly share long prefixes.
+#pragma once
+
 #include <vector>
 #include <iostream>
 #include <tuple>
@@ -23,18 +26,103 @@
 #include <functional>
 #include <utility>
 #include <cmath>
+#include <numeric>
 #include <initializer_list>
+#include <string>
+#include <memory>
+#include <atomic>
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
 
 #include <boost/foreach.hpp>
 #include <boost/range/combine.hpp>
 
 #include "timsort.hh"
+#include "Eytzinger.hh"
+#include "KeyScan.hh"
+#include "HashIndex.hh"
+#include "BloomFilter.hh"
+#include "ThreadPool.hh"
+#include "MappedBigMap.hh"
 #include "general.hh"
 
 namespace matan {
+  //Whose value to keep when both maps have a key, see BigMap::mergeFrom.
+  enum class MergePolicy { KeepOurs, TakeTheirs };
+
+  //Comparators like std::less<> that take more than 1 type mark it with is_transparent.
+  template <typename Compare, typename = void>
+  struct IsTransparent : std::false_type {};
+  template <typename Compare>
+  struct IsTransparent<Compare, std::void_t<typename Compare::is_transparent>> : std::true_type {};
+
+  //Keys without a std::hash get a disabled one, which can't be constructed.
+  template <typename K>
+  struct IsHashable : std::is_default_constructible<std::hash<K>> {};
+
+  /*
+   * What a BigMap has spent its time on, for telling why one got slow.
+   * Only counted when built with -DBIGMAP_STATS, otherwise BigMap::stats()
+   * is all 0s and the counting compiles away.
+   */
+  namespace bigmapstats {
+    enum Counter : size_t {
+      SORTED_SEARCHES, //binary, interpolation or search index lookups
+      UNSORTED_SCANS,  //linear lookups in an unsorted map without the hash index
+      KEYS_SCANNED,    //keys those went over
+      HASH_LOOKUPS,
+      KEYS_SHIFTED,    //keys moved over by inserting or erasing in the middle
+      VALS_SHIFTED,
+      SORTS,
+      INSERT_MERGES,   //insert buffer merged in (see bufferInserts)
+      DEEP_SORTS,      //all the values gathered into a new array
+      VALS_MOVED,      //values those moved
+      KEYS_GROWN,      //m_keys reallocated on append or insert
+      VALS_GROWN,      //m_vals full on append or insert
+      COMPACTS,
+      //Which way remove went, see removeAt.
+      REMOVES_LAZY,    //just marked dead
+      REMOVES_SHIFT,   //deep sorted, keys and values shifted down
+      REMOVES_ERASE,   //sorted, last value moved into the hole and the key erased
+      REMOVES_SWAP,    //unsorted, last key and value moved into the hole
+      OWNER_SCANS,     //had to scan m_keys for who owns the last value
+      BLOOM_REJECTS,   //lookups the bloom filter answered without touching m_keys
+      NUM_COUNTERS
+    };
+
+    constexpr const char* NAMES[NUM_COUNTERS] = {
+      "sorted_searches", "unsorted_scans", "keys_scanned", "hash_lookups", "keys_shifted",
+      "vals_shifted", "sorts", "insert_merges", "deep_sorts", "vals_moved", "keys_grown",
+      "vals_grown", "compacts", "removes_lazy", "removes_shift", "removes_erase",
+      "removes_swap", "owner_scans", "bloom_rejects"
+    };
+
+    struct Stats {
+      u64 counts[NUM_COUNTERS] = {};
+      u64 operator[](Counter c) const { return counts[c]; }
+    };
+
+    /*
+     * The live counts, relaxed atomics since const lookups count too and
+     * those can come from any thread. Atomics can't be copied or moved, so
+     * a copy (or move) starts over from 0, rather than costing BigMap its
+     * default move.
+     */
+    struct Counters {
+      std::atomic<u64> counts[NUM_COUNTERS] = {};
+      Counters() = default;
+      Counters(const Counters&) noexcept {}
+      Counters& operator=(const Counters&) noexcept { return *this; }
+    };
+  } // bigmapstats
+
   template <typename K,
             typename V,
-            bool enforceSortedOnRemove=true>
+            bool enforceSortedOnRemove=true,
+            bool indexHandles=false,
+            typename Compare=std::less<K>,
+            typename Alloc=std::allocator<V>>
   class BigMap {
     //TODO: Use concepts to guarantee K implements operator< and Iter is ForwardIterable I think sorting requires RamdomAccessIterator
     //TODO: need to be able to remove elements
@@ -52,53 +140,515 @@ namespace matan {
      * through vals would have no sequential memory benefits and then
      * we might as well just be using a hashmap.
      *
+     * With indexHandles the keys hold a 32 bit index into m_vals instead of
+     * a pointer. It's a bit more work to get at the value, but m_vals can
+     * reallocate without having to touch m_keys, and for 32 bit keys each
+     * KV is half the size. (64 bit keys still pad KV out to 16 bytes.)
+     * Remove finds the key owning a value through another 4 bytes per
+     * value (see m_valOwners).
+     * Use value(kv) to get at the value while iterating, that works in
+     * either mode.
+     *
+     * Keys are ordered by Compare, which has to agree with == (unsorted
+     * maps find keys by ==, and by std::hash with the hash index). With a
+     * transparent Compare, like std::less<>, lookups take anything it can
+     * compare to a K, so a std::string keyed map can be searched by
+     * std::string_view without building a std::string per lookup.
+     *
+     * Alloc is for the values, and is rebound for the keys, so that both
+     * arrays come from the same place (an arena, huge pages, ...). Every
+     * array the map builds to replace one of these is made with the same
+     * allocator, so that swapping it in never has to copy. The search and
+     * hash indexes are scratch space and still use the default allocator.
      */
   public:
-    typedef std::pair<K, V*> KV;
-    typedef const std::pair<const K, const V*> ConstKV;
-    typedef typename std::vector<KV>::iterator iterator;
-    typedef typename std::vector<KV>::const_iterator const_iterator;
-    typedef typename std::vector<KV>::reverse_iterator reverse_iterator;
-    typedef typename std::vector<KV>::const_reverse_iterator const_reverse_iterator;
+    typedef typename std::conditional<indexHandles, u32, V*>::type Handle;
+    typedef std::pair<K, Handle> KV;
+    typedef const std::pair<const K, const Handle> ConstKV;
+    typedef Compare key_compare;
+    typedef Alloc allocator_type;
+
+  private:
+    typedef std::allocator_traits<Alloc> AllocTraits;
+    typedef std::vector<KV, typename AllocTraits::template rebind_alloc<KV>> Keys;
+    typedef std::vector<V, Alloc> Vals;
+    typedef std::vector<u32, typename AllocTraits::template rebind_alloc<u32>> ValOwners;
+
+    typedef typename Keys::iterator KeyIt;
+    typedef typename Keys::const_iterator ConstKeyIt;
+
+  public:
+    /*
+     * An m_keys iterator that steps over dead keys (see lazyRemove), so
+     * iterating the map only ever sees live ones. With no dead keys that
+     * is just a compare per step. Bidirectional only, since jumping n live
+     * keys ahead means looking at each key on the way.
+     */
+    template <typename It>
+    class LiveIterator {
+    public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef typename std::iterator_traits<It>::value_type value_type;
+      typedef typename std::iterator_traits<It>::reference reference;
+      typedef typename std::iterator_traits<It>::pointer pointer;
+      typedef std::ptrdiff_t difference_type;
+
+      LiveIterator() = default;
+      //pos has to be live or last.
+      LiveIterator(It pos, It last) : m_pos(pos), m_last(last) {}
+      //iterator to const_iterator
+      template <typename Other, typename = std::enable_if_t<std::is_convertible<Other, It>::value>>
+      LiveIterator(const LiveIterator<Other>& other) : m_pos(other.base()), m_last(other.last()) {}
+
+      reference operator*() const { return *m_pos; }
+      pointer operator->() const { return &*m_pos; }
+      It base() const { return m_pos; }
+      It last() const { return m_last; }
+
+      LiveIterator& operator++() { ++m_pos; skipDead(); return *this; }
+      LiveIterator operator++(int) { LiveIterator temp = *this; ++(*this); return temp; }
+      //There's always a live key before anything but begin().
+      LiveIterator& operator--() { do { --m_pos; } while (isDead(*m_pos)); return *this; }
+      LiveIterator operator--(int) { LiveIterator temp = *this; --(*this); return temp; }
+
+      template <typename Other>
+      bool operator==(const LiveIterator<Other>& other) const { return m_pos == other.base(); }
+      template <typename Other>
+      bool operator!=(const LiveIterator<Other>& other) const { return m_pos != other.base(); }
+
+    private:
+      friend class BigMap;
+      void skipDead() {
+        while (m_pos != m_last && isDead(*m_pos))
+          ++m_pos;
+      }
+
+      It m_pos;
+      It m_last;
+    };
+
+    typedef LiveIterator<KeyIt> iterator;
+    typedef LiveIterator<ConstKeyIt> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
   private:
-    std::vector<KV> m_keys;
-    std::vector<V> m_vals;
+    //Lookups that take a Q other than K, only there if Compare is transparent.
+    template <typename Q>
+    using IfTransparent = std::enable_if_t<IsTransparent<Compare>::value &&
+                                           !std::is_same<Q, K>::value>;
+
+    /*
+     * The hash index and bloom filter hash the keys, so keys without a
+     * std::hash get these instead, which never hold anything. That way
+     * such a map still compiles, it just can't useHashIndex or
+     * useBloomFilter.
+     */
+    struct NoHashIndex {
+      static constexpr size_t npos = size_t(-1);
+      template <typename Q, typename KeyAt>
+      size_t find(const Q&, const KeyAt&) const { return npos; }
+      void insert(const K&, size_t) {}
+      template <typename KeyAt>
+      void build(size_t, const KeyAt&) {}
+      void clear() {}
+    };
+    struct NoBloomFilter {
+      template <typename Q>
+      bool mayContain(const Q&) const { return true; }
+      bool insert(const K&) { return false; }
+      template <typename KeyAt>
+      void build(size_t, const KeyAt&) {}
+      void clear() {}
+    };
+
+    Compare m_comp; //first, the search index is built with it
+    Keys m_keys;
+    Vals m_vals;
     bool m_sorted = true;
     bool m_deepSorted = true;
+    /*
+     * Copy of the sorted keys in a cache friendlier order. Only built by
+     * sort() if asked for, and thrown away whenever m_keys changes, at
+     * which point we go back to std::lower_bound until the next sort().
+     */
+    bool m_useSearchIndex = false;
+    EytzingerIndex<K, Compare> m_searchIndex{m_comp};
+    /*
+     * Key -> position in m_keys, so that an unsorted map doesn't have to
+     * scan every key on each lookup (which rawAppend does for every new
+     * key). Only kept up to date while unsorted. sort() drops it, since
+     * from there binary search is fine, and it's rebuilt the next time the
+     * map becomes unsorted.
+     */
+    bool m_useHashIndex = false;
+    std::conditional_t<IsHashable<K>::value, HashIndex<K>, NoHashIndex> m_hashIndex;
+    /*
+     * Search sorted keys by interpolation instead of bisecting (see
+     * interpolateRange). Only for integral keys in ascending order, so
+     * canInterpolate is false for every other map, and the flag is never
+     * looked at.
+     */
+    bool m_useInterpolation = false;
+    /*
+     * Every key in m_keys (dead ones too) is in the bloom filter, so a
+     * lookup it rejects can skip the search. Keys are added as they come
+     * in, and removed ones only leave once sort() or compact() rebuilds it.
+     */
+    bool m_useBloomFilter = false;
+    std::conditional_t<IsHashable<K>::value, BloomFilter<K>, NoBloomFilter> m_bloomFilter;
+    template <typename Q>
+    static constexpr bool canInterpolate() {
+      return std::is_integral<K>::value && std::is_same<Q, K>::value &&
+        (std::is_same<Compare, std::less<K>>::value || std::is_same<Compare, std::less<>>::value);
+    }
+    /*
+     * When buffering inserts on a sorted map, the last m_buffered keys are
+     * a separately sorted run of recent inserts, so an insert only shifts
+     * that run instead of everything after it in m_keys. Once the run hits
+     * m_insertBuffer keys, sort() merges it in, which timsort does in one
+     * linear pass since m_keys is then exactly 2 sorted runs.
+     */
+    size_t m_insertBuffer = 0;
+    size_t m_buffered = 0;
+    /*
+     * Only used with indexHandles. Where in m_keys the key that owns each
+     * value is, so remove can find which key to point at the value it
+     * moves without a scan over m_keys. Anything that moves keys around
+     * has to call keysMoved for them. Values of dead keys are left with
+     * whatever position their key last had.
+     */
+    ValOwners m_valOwners;
+    /*
+     * With lazyRemove, remove only marks the key dead (see kill) and
+     * leaves its value where it is, owned by nobody. Dead keys keep their
+     * place in m_keys, so if the key comes back it just gets a new value,
+     * and the old one stays behind. m_numOrphans counts those values, and
+     * once there are more than m_maxDead of the keys of either, compact()
+     * drops them and the dead keys in one pass.
+     */
+    double m_maxDead = 0;
+    size_t m_numDead = 0;
+    size_t m_numOrphans = 0;
+    /*
+     * Only used with incrementalDeepSort (pointer handles). Once m_vals is
+     * full, new values go into m_relocVals instead, and each new value also
+     * moves up to m_relocStep of the old ones over, in key order. m_relocLeft
+     * is how many live values are still in m_vals, and m_relocCursor the next
+     * key to look at (it wraps, since keys can move around while we go).
+     * Once m_relocLeft gets to 0, m_relocVals becomes m_vals.
+     */
+    size_t m_relocStep = 0;
+    Vals m_relocVals;
+    size_t m_relocLeft = 0;
+    size_t m_relocCursor = 0;
+#ifdef BIGMAP_STATS
+    mutable bigmapstats::Counters m_stats;
+#endif
+    void count(bigmapstats::Counter counter, u64 n=1) const {
+#ifdef BIGMAP_STATS
+      m_stats.counts[counter].fetch_add(n, std::memory_order_relaxed);
+#else
+      (void)counter;
+      (void)n;
+#endif
+    }
 
-    iterator rawFind(const K& key);
+    //All the lookups are templates, so they work for any Q that m_comp takes.
+    template <typename Q>
+    size_t findSlot(const Q& key) const; //m_keys.size() if not found, can be dead
+    template <typename Q>
+    size_t findIndex(const Q& key) const {
+      const size_t i = findSlot(key);
+      return (i != m_keys.size() && isDead(m_keys[i])) ? m_keys.size() : i;
+    }
+    template <typename Q>
+    KeyIt rawFind(const Q& key) { return m_keys.begin() + findIndex(key); }
+    template <typename Q>
+    ConstKeyIt rawFind(const Q& key) const { return m_keys.begin() + findIndex(key); }
+    template <typename Q>
+    KeyIt rawLowerBound(const Q& key);
+    iterator live(KeyIt it) { return iterator(it, m_keys.end()); }
+    const_iterator live(ConstKeyIt it) const { return const_iterator(it, m_keys.end()); }
+    template <typename Q>
+    const KV* findSorted(const KV* first, const KV* last, const Q& key) const {
+      if constexpr (canInterpolate<Q>()) {
+        if (m_useInterpolation)
+          return interpolateSortedKey(first, last, key);
+      }
+      return findSortedKey(first, last, key, m_comp);
+    }
+    template <bool enforceSorted, typename Q>
+    bool rawRemove(const Q& key);
+    void keysChanged() { m_searchIndex.clear(); }
+    void buildSearchIndex();
+    void buildHashIndex();
+    void buildBloomFilter();
+    void keyAdded(const K& key) {
+      if (m_useBloomFilter && m_bloomFilter.insert(key))
+        buildBloomFilter();
+    }
+    void markUnsorted();
+    template <typename... Args>
+    Handle storeVal(size_t owner, Args&&... args); //builds the value in m_vals from args, for m_keys[owner]
+    template <typename... Args>
+    Handle emplaceVal(Args&&... args); //storeVal once there's room, with pointer handles
+    template <typename... Args>
+    static void assignVal(V& val, Args&&... args);
+    template <typename Other>
+    void assignFrom(Other&& other); //memberwise copy or move of other
+    void rebaseHandles(const V* oldVals, const V* oldRelocVals=nullptr);
+    Handle handleOf(size_t i) {
+      if constexpr (indexHandles) return i; else return m_vals.data() + i;
+    }
+    void keysMoved(size_t first, size_t last) { //m_keys[first, last) moved, update m_valOwners
+      if constexpr (indexHandles) {
+        for (size_t i = first; i < last; i++) {
+          if (!isDead(m_keys[i]))
+            m_valOwners[m_keys[i].second] = i;
+        }
+      }
+    }
+    template <bool enforceSorted>
+    void removeAt(KeyIt it);
+    void gatherVals(size_t capacity); //deepSort into an m_vals with at least capacity
+    static Handle deadHandle() {
+      if constexpr (indexHandles) return u32(-1); else return nullptr;
+    }
+    void kill(KV& kv) {
+      if (m_relocLeft != 0 && inOldVals(kv))
+        relocated(1);
+      kv.second = deadHandle();
+      ++m_numDead;
+      ++m_numOrphans; //a bit high if it was in the old array, which goes away
+    }
+    //Time for compact(). deepSort drops orphans but not dead keys, so either can be the most.
+    bool tooManyDead() const { return std::max(m_numDead, m_numOrphans) > m_maxDead * m_keys.size(); }
+    bool inOldVals(const KV& kv) const {
+      if constexpr (indexHandles) return true;
+      else return kv.second >= m_vals.data() && kv.second < m_vals.data() + m_vals.size();
+    }
+    void startRelocating();
+    void relocate(size_t most); //move up to most old values over to m_relocVals
+    void relocated(size_t n); //n fewer old values left, swaps the arrays at 0
+    void finishRelocating();
+    //Whether storing a value first has to move the others, and doing so, with pointer handles.
+    bool valsFull() const {
+      return m_relocLeft != 0 ? m_relocVals.capacity() - m_relocVals.size() <= m_relocLeft
+                              : m_vals.size() == m_vals.capacity();
+    }
+    void makeValRoom();
+    void dropRelocation(); //every value was just gathered elsewhere
+    void sorted(); //bookkeeping once m_keys has been sorted
+
+    template <bool keepOurs, bool keepTheirs, bool keepBoth>
+    void mergeWith(BigMap& other, MergePolicy policy);
 
     template <typename IterK, typename IterV>
     void zipAppend(const IterK& keys, const IterV& vals);
 
-    template <bool noReplace=false>
-    void rawAppend(const K& key, const V& val); //The promise not to change the original is maintained, but I need a non const copy internally
+    /*
+     * These all pass args through untouched to wherever the value gets
+     * built, so an rvalue is moved in rather than copied. replace only uses
+     * args if it finds the key, so its callers can still use them after it
+     * returns false.
+     */
+    template <bool noReplace=false, typename... Args>
+    void rawAppend(const K& key, Args&&... args);
+    template <typename... Args>
+    void rawInsert(const K& key, Args&&... args);
+    template <typename... Args>
+    bool replace(const K& key, Args&&... args);
+    template <typename Iter>
+    void appendPairs(const Iter& pairs);
+
+    //Below this many keys, splitting the work across threads costs more than it saves.
+    static constexpr size_t PARALLEL_MIN = 1 << 16;
+    void settle(); //merge, compact and sort, so m_keys is exactly the sorted keys
+    //findMany over the keys before the insert buffer, misses point at the buffer.
+    template <typename Iter>
+    void gallopMany(Iter first, Iter last, iterator* out);
+    template <typename Iter>
+    void interleaveMany(Iter first, Iter last, iterator* out);
+
+    //m_comp on the keys of KVs, for std::lower_bound, timsort and friends.
+    auto lowerKeyComp() const {
+      return [this](const KV& a, const auto& b) { return m_comp(a.first, b); };
+    }
+    auto keyComp() const {
+      return [this](const KV& a, const KV& b) { return m_comp(a.first, b.first); };
+    }
+  public:
+    /*
+     * Walks a run of m_keys handing out (key, value) pairs instead of
+     * (key, handle). Unless we're deep sorted the values are scattered all
+     * over m_vals, so it prefetches the value PREFETCH_AHEAD keys ahead,
+     * and the cache misses overlap instead of being taken one at a time.
+     *
+     * Dereferencing gives a pair of references by value, so there is no
+     * operator->.
+     */
+    class RangeIterator {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef std::pair<const K&, V&> value_type;
+      typedef value_type reference;
+      typedef void pointer;
+      typedef std::ptrdiff_t difference_type;
+
+      static constexpr size_t PREFETCH_AHEAD = 8;
+
+      RangeIterator(BigMap* map, const KV* pos, const KV* last) :
+        m_map(map), m_pos(pos), m_last(last), m_prefetch(!map->m_deepSorted) {
+        skipDead();
+        if (m_prefetch) {
+          for (const KV* it = m_pos; it != last && it - m_pos < ptrdiff_t(PREFETCH_AHEAD); ++it) {
+            prefetch(*it);
+          }
+        }
+      }
+
+      reference operator*() const { return reference(m_pos->first, m_map->value(*m_pos)); }
+      const K& key() const { return m_pos->first; }
 
-    void rawAppend(const std::pair<const K, const V>& kv) {
-      rawAppend(kv.first, kv.second);
+      RangeIterator& operator++() { //prefix
+        if (m_prefetch && m_last - m_pos > ptrdiff_t(PREFETCH_AHEAD))
+          prefetch(m_pos[PREFETCH_AHEAD]);
+        ++m_pos;
+        skipDead();
+        return *this;
+      }
+
+      RangeIterator operator++(int) { //postfix
+        RangeIterator temp = *this;
+        ++(*this);
+        return temp;
+      }
+
+      bool operator==(const RangeIterator& other) const { return m_pos == other.m_pos; };
+      bool operator!=(const RangeIterator& other) const { return m_pos != other.m_pos; };
+
+    private:
+      //Dead keys are skipped, like with iterator.
+      void skipDead() {
+        while (m_pos != m_last && isDead(*m_pos))
+          ++m_pos;
+      }
+      void prefetch(const KV& kv) const {
+        if (!isDead(kv))
+          __builtin_prefetch(&m_map->value(kv));
+      }
+
+      BigMap* m_map;
+      const KV* m_pos;
+      const KV* m_last;
+      bool m_prefetch;
+    };
+
+    struct Range {
+      RangeIterator first;
+      RangeIterator last;
+      RangeIterator begin() const { return first; }
+      RangeIterator end() const { return last; }
+      bool empty() const { return first == last; }
+    };
+
+    /*
+     * Once deep sorted, m_vals[i] is m_keys[i]'s value, so the 2 arrays
+     * can be walked side by side by index without following any handles,
+     * and the prefetcher streams both. Random access, so it works with
+     * the <algorithm>s, and Val is V or const V.
+     */
+    template <typename Val>
+    class ZipIterator {
+    public:
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef std::pair<const K&, Val&> value_type;
+      typedef value_type reference;
+      typedef void pointer;
+      typedef std::ptrdiff_t difference_type;
+
+      ZipIterator(const KV* key, Val* val) : m_key(key), m_val(val) {}
+
+      reference operator*() const { return reference(m_key->first, *m_val); }
+      reference operator[](difference_type n) const { return reference(m_key[n].first, m_val[n]); }
+      const K& key() const { return m_key->first; }
+      Val& value() const { return *m_val; }
+
+      ZipIterator& operator++() { ++m_key; ++m_val; return *this; }
+      ZipIterator operator++(int) { ZipIterator temp = *this; ++(*this); return temp; }
+      ZipIterator& operator--() { --m_key; --m_val; return *this; }
+      ZipIterator operator--(int) { ZipIterator temp = *this; --(*this); return temp; }
+      ZipIterator& operator+=(difference_type n) { m_key += n; m_val += n; return *this; }
+      ZipIterator& operator-=(difference_type n) { m_key -= n; m_val -= n; return *this; }
+      ZipIterator operator+(difference_type n) const { return ZipIterator(m_key + n, m_val + n); }
+      ZipIterator operator-(difference_type n) const { return ZipIterator(m_key - n, m_val - n); }
+      difference_type operator-(const ZipIterator& other) const { return m_key - other.m_key; }
+
+      bool operator==(const ZipIterator& other) const { return m_key == other.m_key; };
+      bool operator!=(const ZipIterator& other) const { return m_key != other.m_key; };
+      bool operator<(const ZipIterator& other) const { return m_key < other.m_key; };
+      bool operator>(const ZipIterator& other) const { return m_key > other.m_key; };
+      bool operator<=(const ZipIterator& other) const { return m_key <= other.m_key; };
+      bool operator>=(const ZipIterator& other) const { return m_key >= other.m_key; };
+
+    private:
+      const KV* m_key;
+      Val* m_val;
     };
 
-    bool replace(const K& k, const V& v);
-    bool replace(const std::pair<const K, const V>& kv) {
-      return replace(kv.first, kv.second);
+    template <typename Val>
+    struct ZipRange {
+      ZipIterator<Val> first;
+      ZipIterator<Val> last;
+      ZipIterator<Val> begin() const { return first; }
+      ZipIterator<Val> end() const { return last; }
+      size_t size() const { return last - first; }
+      bool empty() const { return first == last; }
     };
 
-    static bool lowerKeyComp(const ConstKV& a, const K& b) { return a.first < b; };
-    static bool keyComp(ConstKV& a, ConstKV& b) { return a.first < b.first; };
+  private:
+    template <typename Q>
+    std::pair<iterator, iterator> rawEqualRange(const Q& key);
+    template <typename Q>
+    Range rawRange(const Q& lo, const Q& hi);
+
   public:
     BigMap() = default; //how to do default constructor/destructor??
 
-    BigMap(const int n);
+    explicit BigMap(const Alloc& alloc) :
+      m_keys(alloc), m_vals(alloc), m_valOwners(alloc), m_relocVals(alloc) {}
 
-    template <typename Iter>
+    explicit BigMap(const Compare& comp, const Alloc& alloc = Alloc()) :
+      m_comp(comp), m_keys(alloc), m_vals(alloc), m_searchIndex(comp), m_valOwners(alloc),
+      m_relocVals(alloc) {}
+
+    BigMap(const int n, const Alloc& alloc = Alloc());
+
+    //Not for allocators, so BigMap(&arena) picks the constructor above.
+    template <typename Iter,
+              typename = std::enable_if_t<!std::is_convertible<Iter, Alloc>::value>>
     BigMap(const Iter& pairs);
 
     template <typename IterK, typename IterV>
     BigMap(const IterK& keys, const IterV& vals);
 
+    /*
+     * With pointer handles the copied keys would still point into other's
+     * values, so they're moved over to point into ours. Moving keeps the
+     * values where they are, unless the allocators differ and won't
+     * propagate, in which case the handles are moved over too.
+     */
+    BigMap(const BigMap& other);
+    BigMap(BigMap&& other) = default;
+    BigMap& operator=(const BigMap& other) { assignFrom(other); return *this; }
+    BigMap& operator=(BigMap&& other) { assignFrom(std::move(other)); return *this; }
+
     ~BigMap() = default;
 
+    allocator_type get_allocator() const { return m_vals.get_allocator(); }
+    key_compare key_comp() const { return m_comp; }
+
     /*
      * I could create my own iterator that rewraps the <K, V*> into <K, V&>,
      * but that will slow things down since I need to hold the actual key
@@ -140,44 +690,162 @@ namespace matan {
         };
         */
 
-    iterator begin() { return m_keys.begin(); }
-    const_iterator begin() const { return m_keys.begin(); }
-    iterator end() { return m_keys.end(); }
-    const_iterator end() const { return m_keys.end(); }
-    reverse_iterator rbegin() { return m_keys.rbegin(); }
-    const_reverse_iterator rbegin() const  { return m_keys.rbegin(); }
-    reverse_iterator rend() { return m_keys.rend(); }
-    const_reverse_iterator rend() const { return m_keys.rend(); }
-
-    typename std::vector<V>::iterator deepBegin() {return m_vals.begin(); }
-    typename std::vector<V>::const_iterator deepBegin() const  { return m_vals.begin(); }
-    typename std::vector<V>::iterator deepEnd()  { return m_vals.end(); }
-    typename std::vector<V>::const_iterator deepEnd() const  { return m_vals.end(); }
-    typename std::vector<V>::reverse_iterator deepRbegin()  { return m_vals.rbegin(); }
-    typename std::vector<V>::const_reverse_iterator deepRbegin() const  { return m_vals.rbegin(); }
-    typename std::vector<V>::reverse_iterator deepRend()  { return m_vals.rend(); }
-    typename std::vector<V>::const_reverse_iterator deepRend() const  { return m_vals.rend(); }
-
-    size_t size() const { return m_keys.size(); }
+    /*
+     * Iterating skips dead keys, but sees buffered inserts unmerged at the
+     * end. mergeInserts() first to have them in order. begin() doesn't do
+     * it for you, since then an end() taken before it would be for a
+     * different m_keys.
+     */
+    iterator begin() { iterator it = live(m_keys.begin()); it.skipDead(); return it; }
+    const_iterator begin() const { const_iterator it = live(m_keys.begin()); it.skipDead(); return it; }
+    iterator end() { return live(m_keys.end()); }
+    const_iterator end() const { return live(m_keys.end()); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const  { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    typename Vals::iterator deepBegin() {return m_vals.begin(); }
+    typename Vals::const_iterator deepBegin() const  { return m_vals.begin(); }
+    typename Vals::iterator deepEnd()  { return m_vals.end(); }
+    typename Vals::const_iterator deepEnd() const  { return m_vals.end(); }
+    typename Vals::reverse_iterator deepRbegin()  { return m_vals.rbegin(); }
+    typename Vals::const_reverse_iterator deepRbegin() const  { return m_vals.rbegin(); }
+    typename Vals::reverse_iterator deepRend()  { return m_vals.rend(); }
+    typename Vals::const_reverse_iterator deepRend() const  { return m_vals.rend(); }
+
+    V& value(const KV& kv) {
+      if constexpr (indexHandles) return m_vals[kv.second]; else return *kv.second;
+    }
+    const V& value(const KV& kv) const {
+      if constexpr (indexHandles) return m_vals[kv.second]; else return *kv.second;
+    }
+
+    /*
+     * Every (key, value) in order, walked in lockstep (see ZipIterator).
+     * Sorts and deep sorts first if need be, so it's meant for whole map
+     * passes over a map that's mostly read. The const one can't, so the
+     * map has to already be isDeepSorted() (like a ConcurrentBigMap
+     * version always is).
+     */
+    ZipRange<V> zipped();
+    ZipRange<const V> zipped() const {
+      assert(m_deepSorted && m_sorted && m_numDead == 0);
+      return ZipRange<const V>{ZipIterator<const V>(m_keys.data(), m_vals.data()),
+                               ZipIterator<const V>(m_keys.data() + m_keys.size(),
+                                                    m_vals.data() + m_keys.size())};
+    }
+
+    /*
+     * What the map has done since it was made or last reset (see
+     * bigmapstats). Copies and moves start from 0. All 0s without
+     * -DBIGMAP_STATS.
+     */
+    bigmapstats::Stats stats() const;
+    void resetStats();
+
+    size_t size() const { return m_keys.size() - m_numDead; }
+    static bool isDead(const KV& kv) { return kv.second == deadHandle(); } //see lazyRemove
     bool isSorted() const { return m_sorted; }
     bool isDeepSorted() const { return m_deepSorted; }
-    iterator find(const K& key) {return rawFind(key); };
-    const const_iterator find(const K& key) const { return rawFind(key); };
+    /*
+     * For maps that are sorted once and then read many times. sort() will
+     * also build a copy of the keys in Eytzinger order, which find and
+     * operator[] can search with far fewer cache misses than a binary
+     * search over m_keys. Costs an extra copy of the keys.
+     */
+    void useSearchIndex(bool use=true);
+    /*
+     * For maps that get appended to a lot before being sorted. Keeps a hash
+     * index of the keys while the map is unsorted, so that append and
+     * lookups are O(1) instead of a linear scan. Needs std::hash<K>.
+     */
+    void useHashIndex(bool use=true);
+    /*
+     * For integral keys that are spread out close to evenly, like
+     * timestamps or sequence numbers. Searches of the sorted keys guess
+     * where the key is from its value instead of bisecting, which takes a
+     * handful of probes instead of log2(n), and falls back to binary search
+     * if the guesses aren't closing in. The search index, if there is one,
+     * is still used first.
+     */
+    void useInterpolation(bool use=true) {
+      static_assert(canInterpolate<K>(), "interpolation needs integral keys sorted by std::less");
+      m_useInterpolation = use;
+    }
+    /*
+     * For maps where most lookups miss. Keeps a blocked bloom filter of the
+     * keys (see BloomFilter.hh) so find and operator[] can turn away a key
+     * that isn't there with 1 probe, without searching (or scanning) the
+     * keys. Costs 2 bytes per key, and a rebuild on every sort(). Needs
+     * std::hash<K>.
+     */
+    void useBloomFilter(bool use=true);
+    /*
+     * For a stream of inserts into a sorted map. Instead of shifting half
+     * the map over on every insert, new keys go into a small sorted buffer
+     * that gets merged in once it holds threshold keys. Lookups check both.
+     * 0 turns buffering off (and merges what's buffered).
+     */
+    void bufferInserts(size_t threshold);
+    void mergeInserts();
+    iterator find(const K& key) {return live(rawFind(key)); };
+    template <typename Q, typename = IfTransparent<Q>>
+    iterator find(const Q& key) { return live(rawFind(key)); }
+    /*
+     * Look up a whole batch of keys at once, out[i] is what find(queries[i])
+     * would give. Returns how many were found. On a sorted map, a sorted
+     * batch is a single galloping walk over the keys, and an unsorted batch
+     * runs many binary searches side by side so their cache misses overlap,
+     * instead of one search waiting on each miss before the next starts.
+     * Unsorted maps just find each key.
+     */
+    template <typename Iter>
+    size_t findMany(const Iter& queries, std::vector<iterator>& out);
+    /*
+     * Ordered queries. These sort the map first if it isn't (and merge any
+     * buffered inserts and drop dead keys), which is why there are no const
+     * versions. range(lo, hi) covers the keys in [lo, hi).
+     */
+    iterator lower_bound(const K& key) { return live(rawLowerBound(key)); }
+    iterator upper_bound(const K& key) { return rawEqualRange(key).second; }
+    std::pair<iterator, iterator> equal_range(const K& key) { return rawEqualRange(key); }
+    Range range(const K& lo, const K& hi) { return rawRange(lo, hi); }
+    Range range(iterator first, iterator last);
+    template <typename Q, typename = IfTransparent<Q>>
+    iterator lower_bound(const Q& key) { return live(rawLowerBound(key)); }
+    template <typename Q, typename = IfTransparent<Q>>
+    iterator upper_bound(const Q& key) { return rawEqualRange(key).second; }
+    template <typename Q, typename = IfTransparent<Q>>
+    std::pair<iterator, iterator> equal_range(const Q& key) { return rawEqualRange(key); }
+    template <typename Q, typename = IfTransparent<Q>>
+    Range range(const Q& lo, const Q& hi) { return rawRange(lo, hi); }
+    const const_iterator find(const K& key) const { return live(rawFind(key)); };
+    template <typename Q, typename = IfTransparent<Q>>
+    const const_iterator find(const Q& key) const { return live(rawFind(key)); }
     V& operator[](const K& key);
     void reserve(const int n);
 
-    void insert(const K& key, const V& val);
+    void insert(const K& key, const V& val) { rawInsert(key, val); }
+    void insert(const K& key, V&& val) { rawInsert(key, std::move(val)); }
 
     void insert(const std::pair<const K, const V>& kv) {
       insert(kv.first, kv.second);
     }
 
+    //insert, but the value is built in place from args.
+    template <typename... Args>
+    void emplace(const K& key, Args&&... args) { rawInsert(key, std::forward<Args>(args)...); }
+
     /*
      * appending is good if don't want to spend time sorting till later.
      *
      * The batch versions are slightly faster since calling them repeatedly
      * would (a) have the overhead of calling to the function repeatedly
      * and (b) would try to reset the bools every time.
+     *
+     * Pairs are copied in, unless iterating pairs gives rvalues, as with
+     * std::make_move_iterator, in which case the values are moved in.
      */
     template <typename Iter>
     void batchInsert(const Iter& pairs);
@@ -187,9 +855,11 @@ namespace matan {
     template <typename IterK, typename IterV>
     void batchInsert(const IterK& keys, const IterV& vals);
 
-    void append(const K& key, const V& val);
+    void append(const K& key, const V& val) { rawAppend(key, val); }
+    void append(const K& key, V&& val) { rawAppend(key, std::move(val)); }
 
     void append(const std::pair<K, V>& kv) { append(kv.first, kv.second); };
+    void append(std::pair<K, V>&& kv) { append(kv.first, std::move(kv.second)); };
 
     template <typename Iter>
     void batchAppend(const Iter& pairs);
@@ -200,319 +870,1200 @@ namespace matan {
     void batchAppend(const IterK& keys, const IterV& vals);
 
     template <bool enforceSorted=enforceSortedOnRemove>
-    bool remove(const K& key);
+    bool remove(const K& key) { return rawRemove<enforceSorted>(key); }
+    template <bool enforceSorted=enforceSortedOnRemove, typename Q, typename = IfTransparent<Q>>
+    bool remove(const Q& key) { return rawRemove<enforceSorted>(key); }
+
+    /*
+     * Remove every key in keys, then compact once at the end, instead of
+     * paying for a shift per key. Returns how many were actually there.
+     */
+    template <typename Iter>
+    size_t removeBatch(const Iter& keys);
+
+    /*
+     * For maps that remove a lot. Removing just marks the key as dead,
+     * and once more than maxDeadFraction of the keys are dead, they are all
+     * dropped (and the values deep sorted) in one pass. Lookups and
+     * iteration skip dead keys.
+     * 0 goes back to removing immediately.
+     */
+    void lazyRemove(double maxDeadFraction);
+    void compact(); //drop dead keys now, and merge any buffered inserts
     //TODO: If the user can pass in val, that will make things faster since won't have to search. overload
 
     bool hasVal(const V& val) const;
     void sort(); //sort m_keys
     void deepSort(); //reorder m_vals according to m_keys.
+    /*
+     * Same as above, but split across the threads of pool. Both end with
+     * pool.waitFinished(), so don't share the pool with anything that might
+     * still be running. Small maps just do it on this thread.
+     */
+    void sort(ThreadPool& pool);
+    void deepSort(ThreadPool& pool);
+    /*
+     * Pointer handles only. Once m_vals is full, the append that finds it
+     * full normally gathers every value into a new array twice the size
+     * (see deepSort), which on a big map is a long pause in the middle of
+     * an append. With step > 0 that append starts a new array without
+     * copying anything, and it and every append after it move step more
+     * values over, in key order, until the old array is empty. Removing,
+     * compacting or deepSort() part way through finishes the move on the
+     * spot. The new values are mixed in with the moved ones, so values end
+     * up mostly in key order but the map isn't isDeepSorted() until a
+     * deepSort(). Both arrays are held until the move is done. 0 turns it
+     * off (and finishes any move underway).
+     */
+    void incrementalDeepSort(size_t step);
+
+    /*
+     * Set operations with another map, each a single linear merge of the 2
+     * sorted key arrays (sorting either map first if it isn't), which
+     * leaves this map deep sorted. policy picks whose value a key in both
+     * ends up with. Their values are copied, ours moved.
+     *   mergeFrom - keys in either map
+     *   intersectWith - keys in both maps
+     *   subtract - our keys that aren't in other
+     */
+    void mergeFrom(BigMap& other, MergePolicy policy=MergePolicy::TakeTheirs);
+    void intersectWith(BigMap& other, MergePolicy policy=MergePolicy::KeepOurs);
+    void subtract(BigMap& other);
+
+    /*
+     * Write the map out for MappedBigMap to open. K and V must be trivially
+     * copyable. Sorts and deep sorts first if need be. False if the file
+     * couldn't be written.
+     */
+    bool saveSnapshot(const std::string& path);
 
   };
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  BigMap<K, V, enforceSortedOnRemove>::BigMap(const int n) {
+#if __has_include(<memory_resource>)
+  namespace pmr {
+    //Keys and values come from a std::pmr::memory_resource given to the constructor.
+    template <typename K, typename V, bool enforceSortedOnRemove=true, bool indexHandles=false,
+              typename Compare=std::less<K>>
+    using BigMap = matan::BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare,
+                                 std::pmr::polymorphic_allocator<V>>;
+  } // pmr
+#endif
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::BigMap(const int n, const Alloc& alloc) :
+    BigMap(alloc) {
     m_keys.reserve(n);
     m_vals.reserve(n);
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  template<typename Iter>
-  BigMap<K, V, enforceSortedOnRemove>::BigMap(const Iter& pairs)  {
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::BigMap(const BigMap& other) :
+    BigMap(AllocTraits::select_on_container_copy_construction(other.get_allocator())) {
+    assignFrom(other);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Other>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::assignFrom(Other&& other) {
+    if (this == &other)
+      return;
+    const V* const oldVals = other.m_vals.data();
+    const V* const oldRelocVals = other.m_relocVals.data();
+    m_comp = other.m_comp;
+    m_keys = std::forward<Other>(other).m_keys;
+    m_vals = std::forward<Other>(other).m_vals;
+    m_sorted = other.m_sorted;
+    m_deepSorted = other.m_deepSorted;
+    m_useSearchIndex = other.m_useSearchIndex;
+    m_searchIndex = std::forward<Other>(other).m_searchIndex;
+    m_useHashIndex = other.m_useHashIndex;
+    m_hashIndex = std::forward<Other>(other).m_hashIndex;
+    m_useInterpolation = other.m_useInterpolation;
+    m_useBloomFilter = other.m_useBloomFilter;
+    m_bloomFilter = std::forward<Other>(other).m_bloomFilter;
+    m_insertBuffer = other.m_insertBuffer;
+    m_buffered = other.m_buffered;
+    m_valOwners = std::forward<Other>(other).m_valOwners;
+    m_maxDead = other.m_maxDead;
+    m_numDead = other.m_numDead;
+    m_numOrphans = other.m_numOrphans;
+    m_relocStep = other.m_relocStep;
+    m_relocVals = std::forward<Other>(other).m_relocVals;
+    m_relocLeft = other.m_relocLeft;
+    m_relocCursor = other.m_relocCursor;
+    rebaseHandles(oldVals, oldRelocVals);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::rebaseHandles(const V* oldVals,
+                                                                         const V* oldRelocVals) {
+    if constexpr (!indexHandles) {
+      if (m_vals.data() == oldVals && m_relocVals.data() == oldRelocVals)
+        return;
+      //Part way through incrementalDeepSort a value could be in either array.
+      for (KV& kv : m_keys) {
+        if (isDead(kv))
+          continue;
+        if (kv.second >= oldVals && kv.second < oldVals + m_vals.size())
+          kv.second = m_vals.data() + (kv.second - oldVals);
+        else
+          kv.second = m_relocVals.data() + (kv.second - oldRelocVals);
+      }
+    }
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template<typename Iter, typename>
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::BigMap(const Iter& pairs)  {
     m_keys.reserve(pairs.size());
     m_vals.reserve(pairs.size());
     batchInsert(pairs);
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
   template <typename IterK, typename IterV>
-  BigMap<K, V, enforceSortedOnRemove>::BigMap(const IterK& keys,
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::BigMap(const IterK& keys,
                        const IterV& vals) {
     m_keys.reserve(keys.size());
     m_vals.reserve(vals.size());
     batchInsert(keys, vals);
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  bool BigMap<K, V, enforceSortedOnRemove>::hasVal(const V& val) const {
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  bool BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::hasVal(const V& val) const {
+    //Values moved out of the old array are still there, just moved from.
+    if (m_numOrphans != 0 || m_relocLeft != 0) {
+      return std::find_if(m_keys.begin(), m_keys.end(), [this, &val](const KV& kv) {
+          return !isDead(kv) && value(kv) == val;
+        }) != m_keys.end();
+    }
     return std::find(m_vals.begin(), m_vals.end(), val) != m_vals.end();
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  V& BigMap<K, V, enforceSortedOnRemove>::operator[](const K& key) {
-    iterator it = rawFind(key);
-    if (it == end()) {
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  V& BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::operator[](const K& key) {
+    KeyIt it = m_keys.begin() + findSlot(key);
+    if (it != m_keys.end() && isDead(*it)) {
+      replace(key, V());
+      return value(*it);
+    }
+    if (it == m_keys.end()) {
       if (m_sorted) {
         insert(key, V());
-        return *(rawFind(key)->second);
+        return value(*rawFind(key));
       } else {
         rawAppend<true>(key, V());
-        return m_vals.back();
+        return value(m_keys.back());
       }
     }
-    return *(it->second);
+    return value(*it);
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  void BigMap<K, V, enforceSortedOnRemove>::reserve(const int n) {
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::reserve(const int n) {
+    finishRelocating();
+    const V* const oldVals = m_vals.data();
     m_keys.reserve(n);
     m_vals.reserve(n);
+    rebaseHandles(oldVals, m_relocVals.data());
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  void BigMap<K, V, enforceSortedOnRemove>::insert(const K& key, const V& val) {
-    if (replace(key, val)) {
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename... Args>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::rawInsert(const K& key, Args&&... args) {
+    if (replace(key, std::forward<Args>(args)...)) {
       if (!m_sorted)
         sort();
     } else if (!m_sorted) {
-      m_vals.push_back(val);
-      m_keys.push_back( KV(key, &m_vals.back()));
+      const Handle hval = storeVal(m_keys.size(), std::forward<Args>(args)...);
+      m_keys.push_back( KV(key, hval));
       sort();
+    } else if (m_insertBuffer == 0) {
+      keysChanged();
+      const size_t pos = std::lower_bound(m_keys.begin(),
+                                          m_keys.end(),
+                                          key,
+                                          lowerKeyComp()) - m_keys.begin();
+      const Handle hval = storeVal(pos, std::forward<Args>(args)...);
+      count(bigmapstats::SORTED_SEARCHES);
+      count(bigmapstats::KEYS_SHIFTED, m_keys.size() - pos);
+      if (m_keys.size() == m_keys.capacity())
+        count(bigmapstats::KEYS_GROWN);
+      m_keys.insert(m_keys.begin() + pos, KV(key, hval));
+      keysMoved(pos + 1, m_keys.size());
+      keyAdded(key);
     } else {
-      m_vals.push_back(val);
-      m_keys.resize(m_keys.size()+1);
-      const auto breakpoint = std::lower_bound(m_keys.begin(),
-                                               m_keys.end(),
-                                               key,
-                                               lowerKeyComp);
-      int i = m_keys.size();
-      for (auto it = m_keys.end(); it != breakpoint; it--, i--) {
-        m_keys[i] = m_keys[i-1];
-      }
-      m_keys[i] = KV(key, &m_vals.back());
+      //Only the buffered run is shifted, so the search index is still good.
+      const size_t pos = std::lower_bound(m_keys.end() - m_buffered,
+                                          m_keys.end(),
+                                          key,
+                                          lowerKeyComp()) - m_keys.begin();
+      const Handle hval = storeVal(pos, std::forward<Args>(args)...);
+      count(bigmapstats::KEYS_SHIFTED, m_keys.size() - pos);
+      if (m_keys.size() == m_keys.capacity())
+        count(bigmapstats::KEYS_GROWN);
+      m_keys.insert(m_keys.begin() + pos, KV(key, hval));
+      keysMoved(pos + 1, m_keys.size());
+      keyAdded(key);
+      if (++m_buffered >= m_insertBuffer)
+        mergeInserts();
     }
     m_deepSorted = false;
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::bufferInserts(size_t threshold) {
+    m_insertBuffer = threshold;
+    if (threshold == 0)
+      mergeInserts();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::useSearchIndex(bool use) {
+    m_useSearchIndex = use;
+    if (use && m_sorted)
+      buildSearchIndex();
+    else
+      m_searchIndex.clear();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::useHashIndex(bool use) {
+    static_assert(IsHashable<K>::value, "the hash index needs std::hash<K>");
+    m_useHashIndex = use;
+    if (use && !m_sorted)
+      buildHashIndex();
+    else
+      m_hashIndex.clear();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::useBloomFilter(bool use) {
+    static_assert(IsHashable<K>::value, "the bloom filter needs std::hash<K>");
+    m_useBloomFilter = use;
+    if (use)
+      buildBloomFilter();
+    else
+      m_bloomFilter.clear();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::buildBloomFilter() {
+    m_bloomFilter.build(m_keys.size(), [this](size_t i) -> const K& { return m_keys[i].first; });
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::buildHashIndex() {
+    m_hashIndex.build(m_keys.size(), [this](size_t i) -> const K& { return m_keys[i].first; });
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::markUnsorted() {
+    if (!m_sorted)
+      return;
+    m_sorted = false;
+    keysChanged();
+    if (m_useHashIndex)
+      buildHashIndex();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::buildSearchIndex() {
+    m_searchIndex.build(m_keys.begin(), m_keys.end(),
+                        [](const KV& kv) -> const K& { return kv.first; });
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
   template <typename Iter>
-  void BigMap<K, V, enforceSortedOnRemove>::batchInsert(const Iter& pairs) {
-    for (const std::pair<K, V>& it : pairs) {
-      rawAppend(it);
-    }
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::batchInsert(const Iter& pairs) {
+    appendPairs(pairs);
     sort();
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  void BigMap<K, V, enforceSortedOnRemove>::batchInsert(const std::initializer_list<std::pair<K, V>>&& pairs) {
-    for (const std::pair<K, V>& it : pairs) {
-      rawAppend(it);
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Iter>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::appendPairs(const Iter& pairs) {
+    for (auto&& kv : pairs) {
+      //kv is an rvalue if pairs hands out rvalues, and then so is its value.
+      rawAppend(kv.first, std::forward<decltype(kv)>(kv).second);
     }
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::batchInsert(const std::initializer_list<std::pair<K, V>>&& pairs) {
+    appendPairs(pairs);
     sort();
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  bool BigMap<K, V, enforceSortedOnRemove>::replace(const K& key, const V& val) {
-    BigMap::iterator it = rawFind(key);
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename... Args>
+  bool BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::replace(const K& key, Args&&... args) {
+    KeyIt it = m_keys.begin() + findSlot(key);
     if (it == m_keys.end())
       return false;
 
-    *(it->second) = const_cast<V&>(val); //The promise not to change the original is maintained, but I need a non const copy internally
+    if (unlikely(isDead(*it))) {
+      //Doesn't move it, and m_vals reallocating only moves values around.
+      it->second = storeVal(it - m_keys.begin(), std::forward<Args>(args)...);
+      --m_numDead;
+      m_deepSorted = false;
+      return true;
+    }
+    assignVal(value(*it), std::forward<Args>(args)...);
     return true;
   };
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename... Args>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::assignVal(V& val, Args&&... args) {
+    //Plain assignment if we were given something to assign, else build a V to move in.
+    if constexpr (sizeof...(Args) == 1 && (std::is_assignable<V&, Args&&>::value && ...))
+      ((val = std::forward<Args>(args)), ...);
+    else
+      val = V(std::forward<Args>(args)...);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
   template <typename IterK, typename IterV>
-  void BigMap<K, V, enforceSortedOnRemove>::batchInsert(const IterK& keys, const IterV& vals) {
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::batchInsert(const IterK& keys, const IterV& vals) {
     zipAppend(keys, vals);
-    if (!m_sorted)
-      sort();
-    m_deepSorted = false;
+    sort();
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  template <bool noReplace>
-  void BigMap<K, V, enforceSortedOnRemove>::rawAppend(const K& key, const V& val) {
-    if (!noReplace && replace(key, val))
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <bool noReplace, typename... Args>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::rawAppend(const K& key, Args&&... args) {
+    if (!noReplace && replace(key, std::forward<Args>(args)...))
         return;
 
-    const bool reassign = (m_vals.size() == m_vals.capacity());
-    if (reassign) {
-      deepSort();
+    mergeInserts();
+    //Appending in order doesn't cost us being sorted.
+    if (!m_keys.empty() && !m_comp(m_keys.back().first, key))
+      markUnsorted();
+
+    const Handle hval = storeVal(m_keys.size(), std::forward<Args>(args)...);
+    if (m_keys.size() == m_keys.capacity())
+      count(bigmapstats::KEYS_GROWN);
+    m_keys.push_back( KV(key, hval) );
+    keysChanged();
+    keyAdded(key);
+    if (!m_sorted && m_useHashIndex)
+      m_hashIndex.insert(key, m_keys.size()-1);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename... Args>
+  typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::Handle
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::storeVal(size_t owner, Args&&... args) {
+    if constexpr (indexHandles) {
+      assert(m_vals.size() < u32(-1));
+      m_vals.emplace_back(std::forward<Args>(args)...);
+      m_valOwners.push_back(owner);
+      return m_vals.size() - 1;
+    } else {
+      if (!valsFull())
+        return emplaceVal(std::forward<Args>(args)...);
+      //Making room moves our values, and args may refer to one of them, as with append(k, m[x]).
+      V val(std::forward<Args>(args)...);
+      makeValRoom();
+      return emplaceVal(std::move(val));
     }
-    m_vals.push_back(val);
-    if (reassign) {
-      V* phead = &m_vals[0];
-      const int size = m_keys.size();
-      for (int i = 0; i < size; i++) {
-        m_keys[i].second = phead+i;
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename... Args>
+  typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::Handle
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::emplaceVal(Args&&... args) {
+    if constexpr (!indexHandles) {
+      if (m_relocLeft == 0) {
+        m_vals.emplace_back(std::forward<Args>(args)...);
+        return &m_vals.back();
       }
+      //Before moving anything, in case args refers to one of our values.
+      m_relocVals.emplace_back(std::forward<Args>(args)...);
+      V* const val = &m_relocVals.back();
+      relocate(m_relocStep);
+      return val;
     }
-    m_keys.push_back( KV(key, &m_vals.back()) );
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  void BigMap<K, V, enforceSortedOnRemove>::append(const K& key, const V& val) {
-    rawAppend(key, val);
-    m_sorted = false;
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::makeValRoom() {
+    //Always leave room to move the rest over, m_relocVals can't reallocate either.
+    if (m_relocLeft != 0 && m_relocVals.capacity() - m_relocVals.size() <= m_relocLeft)
+      finishRelocating();
+    /*
+     * If m_vals is about to reallocate every pointer in m_keys goes stale.
+     * We have to rewrite them all anyways, so may as well deepSort.
+     */
+    if (m_relocLeft == 0 && m_vals.size() == m_vals.capacity()) {
+      count(bigmapstats::VALS_GROWN);
+      if (m_relocStep != 0 && m_keys.size() > m_numDead)
+        startRelocating();
+      else
+        gatherVals(2 * m_vals.size() + 1);
+    }
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
   template <typename Iter>
-  void BigMap<K, V, enforceSortedOnRemove>::batchAppend(const Iter& pairs) {
-    for (const std::pair<K, V>& it : pairs) {
-      rawAppend(it);
-    }
-    m_sorted = false;
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::batchAppend(const Iter& pairs) {
+    appendPairs(pairs);
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  void BigMap<K, V, enforceSortedOnRemove>::batchAppend(const std::initializer_list<std::pair<K, V>>&& pairs) {
-    for (const std::pair<K, V>& it : pairs) {
-      rawAppend(it);
-    }
-    m_sorted = false;
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::batchAppend(const std::initializer_list<std::pair<K, V>>&& pairs) {
+    appendPairs(pairs);
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
   template <typename IterK, typename IterV>
-  void BigMap<K, V, enforceSortedOnRemove>::batchAppend(const IterK& keys, const IterV& vals) {
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::batchAppend(const IterK& keys, const IterV& vals) {
     zipAppend(keys, vals);
-    m_sorted = false;
     m_deepSorted = false;
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  template <bool enforceSorted>
-  bool BigMap<K, V, enforceSortedOnRemove>::remove(const K& key) {
-    //I think always will maintain m_deepSorted if true so don't need the template parameter
-
-    iterator it = rawFind(key);
-    std::cout << it->first << ' ' << it->second << ' ' << *(it->second) << std::endl;
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <bool enforceSorted, typename Q>
+  bool BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::rawRemove(const Q& key) {
+    if (m_maxDead > 0) {
+      const size_t i = findIndex(key);
+      if (i == m_keys.size())
+        return false;
+      kill(m_keys[i]);
+      count(bigmapstats::REMOVES_LAZY);
+      if (tooManyDead())
+        compact();
+      return true;
+    }
 
+    mergeInserts();
+    compact();
+    KeyIt it = rawFind(key);
     if (it == m_keys.end())
         return false;
+    keysChanged();
+    removeAt<enforceSorted>(it);
+    return true;
+  }
 
-    if (unlikely(m_keys.back().first == key)) {
-      std::cout << "1" << std::endl;
-      KV& backKey = m_keys.back();
-      const V& backVal = m_vals.back();
-      if (likely(backKey.second != &backVal)) {
-        for (auto& kv : m_keys) {
-          if (unlikely(kv.second == &backVal)) {
-            *backKey.second = backVal;
-            kv.second = backKey.second;
-            break;
-          }
-        }
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <bool enforceSorted>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::removeAt(KeyIt it) {
+    finishRelocating(); //m_vals.back() has to be a value
+    const size_t pos = std::distance(m_keys.begin(), it);
+    if (enforceSorted && m_sorted && m_deepSorted) {
+      //Shift both keys and values down by 1 so we stay deep sorted.
+      count(bigmapstats::REMOVES_SHIFT);
+      count(bigmapstats::KEYS_SHIFTED, m_keys.size() - pos - 1);
+      count(bigmapstats::VALS_SHIFTED, m_keys.size() - pos - 1);
+      m_keys.erase(it);
+      m_vals.erase(m_vals.begin() + pos);
+      if constexpr (indexHandles)
+        m_valOwners.pop_back();
+      for (size_t i = pos; i < m_keys.size(); i++) {
+        m_keys[i].second = handleOf(i);
       }
-      m_vals.pop_back();
-      m_keys.pop_back();
-    } else if (enforceSorted && m_sorted && m_deepSorted) {
-      std::cout << "2" << std::endl;
-      const iterator end = m_keys.end();
-      for(; it != (end-1); it++) {
-        it->first = (it+1)->first;
-        *(it->second) = *((it+1)->second);
+      keysMoved(pos, m_keys.size());
+      return;
+    }
+
+    /*
+     * Move the last value into the hole and point whoever owned it there.
+     * If we're deep sorted that's the last key, with indexHandles
+     * m_valOwners says where it is, otherwise we have to go looking.
+     */
+    V& hole = value(*it);
+    V& back = m_vals.back();
+    if (&hole != &back) {
+      const Handle backHandle = handleOf(m_vals.size() - 1);
+      KeyIt owner = m_keys.end();
+      if (m_deepSorted) {
+        owner = m_keys.end() - 1;
+      } else if constexpr (indexHandles) {
+        if (m_valOwners.back() < m_keys.size())
+          owner = m_keys.begin() + m_valOwners.back();
+      } else {
+        count(bigmapstats::OWNER_SCANS);
+        owner = std::find_if(m_keys.begin(), m_keys.end(),
+                             [backHandle](const KV& kv) { return kv.second == backHandle; });
       }
-      m_keys.pop_back();
-      m_vals.pop_back();
-    } else if (enforceSorted && m_sorted) {
-      std::cout << "3" << std::endl;
-      const V* pBackVal = &m_vals.back();
-      int backValKInd = -1;
-      const int valKInd = std::distance(m_keys.begin(), it);
-      const int size = m_keys.size();
-      for (int i=0; i < valKInd; i++) {
-        if (unlikely(m_keys[i].second == pBackVal)) {
-          backValKInd = i;
-          m_keys[backValKInd].second = m_keys[valKInd].second;
-          *(m_keys[backValKInd].second) = *pBackVal;
-        }
+      hole = std::move(back);
+      if constexpr (indexHandles)
+        m_valOwners[it->second] = m_valOwners.back();
+      //An orphan (see m_numOrphans) has no owner to point at the hole.
+      if (owner != m_keys.end() && owner->second == backHandle)
+        owner->second = it->second;
+    }
+    m_vals.pop_back();
+    if constexpr (indexHandles)
+      m_valOwners.pop_back();
+
+    if (enforceSorted && m_sorted) {
+      count(bigmapstats::REMOVES_ERASE);
+      count(bigmapstats::KEYS_SHIFTED, m_keys.end() - it - 1);
+      m_keys.erase(it);
+      keysMoved(pos, m_keys.size());
+      return;
+    }
+    count(bigmapstats::REMOVES_SWAP);
+    /*
+     * Move the last key into the hole. If we were deep sorted, its value
+     * was the last one, and we just moved that into this spot too.
+     */
+    const bool wasBack = (pos == m_keys.size() - 1);
+    *it = m_keys.back();
+    m_keys.pop_back();
+    if (!wasBack)
+      keysMoved(pos, pos + 1);
+    if (m_sorted && !wasBack)
+      markUnsorted();
+    else if (!m_sorted && m_useHashIndex)
+      buildHashIndex();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Iter>
+  size_t BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::removeBatch(const Iter& keys) {
+    size_t removed = 0;
+    for (const K& key : keys) {
+      const size_t i = findIndex(key);
+      if (i != m_keys.size()) {
+        kill(m_keys[i]);
+        count(bigmapstats::REMOVES_LAZY);
+        ++removed;
+      }
+    }
+    if (m_maxDead == 0 || tooManyDead())
+      compact();
+    return removed;
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::lazyRemove(double maxDeadFraction) {
+    m_maxDead = maxDeadFraction;
+    if (maxDeadFraction == 0)
+      compact();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::compact() {
+    //Dead keys could be anywhere in the buffered run, easier to just merge it.
+    mergeInserts();
+    if (m_numDead == 0 && m_numOrphans == 0)
+      return;
+    count(bigmapstats::COMPACTS);
+    gatherVals(m_vals.capacity());
+    m_keys.erase(std::remove_if(m_keys.begin(), m_keys.end(),
+                                [](const KV& kv) { return isDead(kv); }),
+                 m_keys.end());
+    keysMoved(0, m_keys.size());
+    m_numDead = 0;
+    m_deepSorted = true;
+    keysChanged();
+    if (m_sorted && m_useSearchIndex)
+      buildSearchIndex();
+    if (!m_sorted && m_useHashIndex)
+      buildHashIndex();
+    if (m_useBloomFilter)
+      buildBloomFilter();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Q>
+  size_t BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::findSlot(const Q& key) const {
+    if (m_useBloomFilter && !m_bloomFilter.mayContain(key)) {
+      count(bigmapstats::BLOOM_REJECTS);
+      return m_keys.size();
+    }
+    if (!m_sorted && m_useHashIndex) {
+      count(bigmapstats::HASH_LOOKUPS);
+      const size_t i = m_hashIndex.find(key, [this](size_t i) -> const K& { return m_keys[i].first; });
+      return i == m_hashIndex.npos ? m_keys.size() : i;
+    }
+
+    const KV* first = m_keys.data();
+    const KV* last = first + m_keys.size();
+    if (!m_sorted) {
+      const size_t i = scanKeys(first, last, key) - first;
+      count(bigmapstats::UNSORTED_SCANS);
+      count(bigmapstats::KEYS_SCANNED, std::min(i + 1, m_keys.size()));
+      return i;
+    }
+
+    count(bigmapstats::SORTED_SEARCHES);
+    //The search index (if there is one) only covers the keys before the buffer.
+    const KV* buffered = last - m_buffered;
+    const size_t i = m_searchIndex.empty() ? findSorted(first, buffered, key) - first
+                                           : m_searchIndex.find(key);
+    if (i != size_t(buffered - first) || m_buffered == 0)
+      return i;
+    return findSorted(buffered, last, key) - first;
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Iter>
+  size_t BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::findMany(const Iter& queries,
+                                                                     std::vector<iterator>& out) {
+    const auto first = std::begin(queries);
+    const auto last = std::end(queries);
+    out.resize(std::distance(first, last));
+    if (!m_sorted) {
+      std::transform(first, last, out.begin(), [this](const auto& key) { return live(rawFind(key)); });
+    } else {
+      if (std::is_sorted(first, last, m_comp))
+        gallopMany(first, last, out.data());
+      else
+        interleaveMany(first, last, out.data());
+
+      //Then anything that missed might be in the buffer, or found dead.
+      const KV* data = m_keys.data();
+      const KV* buffered = data + m_keys.size() - m_buffered;
+      const KeyIt bufferBegin = m_keys.end() - m_buffered;
+      auto key = first;
+      for (iterator& found : out) {
+        KeyIt it = found.base();
+        if (it == bufferBegin && m_buffered != 0)
+          it = m_keys.begin() + (findSortedKey(buffered, data + m_keys.size(), *key, m_comp) - data);
+        if (it != m_keys.end() && isDead(*it))
+          it = m_keys.end();
+        found = live(it);
+        ++key;
+      }
+    }
+    return std::count_if(out.begin(), out.end(),
+                         [this](const iterator& it) { return it.base() != m_keys.end(); });
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Iter>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::gallopMany(Iter first, Iter last,
+                                                                     iterator* out) {
+    /*
+     * Each key starts looking where the last one was found. Gallop forward
+     * in doubling steps until we pass it, then binary search that last
+     * step. Dense batches only take a step or 2 per key, sparse ones
+     * O(log gap), and neither goes back over keys already passed.
+     */
+    const KeyIt end = m_keys.end() - m_buffered;
+    KeyIt pos = m_keys.begin();
+    for (; first != last; ++first, ++out) {
+      const auto& key = *first;
+      size_t step = 1;
+      KeyIt lo = pos;
+      while (end - lo > ptrdiff_t(step) && m_comp(lo[step].first, key)) {
+        lo += step;
+        step *= 2;
       }
-      for (int i=valKInd; i<(size-1); i++) {
-        if (unlikely((backValKInd == -1) && (m_keys[i].second == pBackVal))) {
-          backValKInd = i;
-          m_keys[backValKInd].second = m_keys[valKInd].second;
-          *(m_keys[backValKInd].second) = *pBackVal;
+      pos = std::lower_bound(lo, lo + std::min(ptrdiff_t(step) + 1, end - lo), key, lowerKeyComp());
+      *out = live((pos != end && !m_comp(key, pos->first)) ? pos : end);
+    }
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Iter>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::interleaveMany(Iter first, Iter last,
+                                                                         iterator* out) {
+    /*
+     * GROUP branchless binary searches advance a step at a time together.
+     * They're all over the same range, so they all take the same number of
+     * steps, and we prefetch each one's next probe before going back to
+     * the first, so the misses of a step are all in flight at once.
+     */
+    constexpr size_t GROUP = 16;
+    const KV* data = m_keys.data();
+    const size_t size = m_keys.size() - m_buffered;
+    const KeyIt end = m_keys.end() - m_buffered;
+    while (first != last) {
+      const size_t group = std::min<size_t>(GROUP, std::distance(first, last));
+      const KV* base[GROUP];
+      const std::remove_reference_t<decltype(*first)>* keys[GROUP];
+      for (size_t j = 0; j < group; j++, ++first) {
+        base[j] = data;
+        keys[j] = &*first;
+      }
+      size_t n = size;
+      while (n > 1) {
+        const size_t half = n / 2;
+        for (size_t j = 0; j < group; j++) {
+          base[j] = m_comp(base[j][half].first, *keys[j]) ? base[j] + half : base[j];
+        }
+        n -= half;
+        for (size_t j = 0; j < group; j++) {
+          __builtin_prefetch(base[j] + n / 2);
         }
-        m_keys[i] = m_keys[i+1];
       }
-      m_vals.pop_back();
-      m_keys.pop_back();
-    } else if (m_deepSorted) {
-      std::cout << "4" << std::endl;
-      if (m_sorted) {
-        KV& kv = *it;
-        *kv.second = m_vals.back();
-        kv.first = m_keys.back().first;
-        m_keys.pop_back();
-        m_vals.pop_back();
+      for (size_t j = 0; j < group; j++, ++out) {
+        const KV* it = base[j];
+        if (size != 0 && m_comp(it->first, *keys[j]))
+          ++it;
+        *out = live((it != data + size && !m_comp(*keys[j], it->first)) ? m_keys.begin() + (it - data) : end);
+      }
+    }
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::mergeFrom(BigMap& other, MergePolicy policy) {
+    mergeWith<true, true, true>(other, policy);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::intersectWith(BigMap& other, MergePolicy policy) {
+    mergeWith<false, false, true>(other, policy);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::subtract(BigMap& other) {
+    mergeWith<true, false, false>(other, MergePolicy::KeepOurs);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <bool keepOurs, bool keepTheirs, bool keepBoth>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::mergeWith(BigMap& other, MergePolicy policy) {
+    settle();
+    if (this != &other)
+      other.settle();
+
+    /*
+     * Build the new keys and values side by side, so we come out deep
+     * sorted. Everything is reserved up front, so pointers into vals stay
+     * good.
+     */
+    const size_t most = keepTheirs ? m_keys.size() + other.m_keys.size() :
+                        keepOurs ? m_keys.size() : std::min(m_keys.size(), other.m_keys.size());
+    Keys keys(m_keys.get_allocator());
+    Vals vals(m_vals.get_allocator());
+    ValOwners valOwners(m_valOwners.get_allocator());
+    keys.reserve(most);
+    vals.reserve(std::max(most, m_vals.capacity()));
+    if constexpr (indexHandles)
+      valOwners.reserve(vals.capacity());
+    const auto take = [&keys, &vals, &valOwners](const K& key, auto&& val) {
+      vals.push_back(std::forward<decltype(val)>(val));
+      if constexpr (indexHandles) {
+        valOwners.push_back(keys.size());
+        keys.push_back(KV(key, vals.size() - 1));
       } else {
-        for (KV& kv : m_keys) {
-          if (unlikely(kv.first == key)) {
-            *kv.second = m_vals.back();
-            kv.first = m_keys.back().first;
-            m_keys.pop_back();
-            m_vals.pop_back();
-            break;
-          }
+        keys.push_back(KV(key, &vals.back()));
+      }
+    };
+
+    const bool ours = (policy == MergePolicy::KeepOurs);
+    auto a = m_keys.begin();
+    auto b = other.m_keys.begin();
+    const auto aEnd = m_keys.end();
+    const auto bEnd = other.m_keys.end();
+    while ((a != aEnd || keepTheirs) && (b != bEnd || keepOurs) && (a != aEnd || b != bEnd)) {
+      if (b == bEnd || (a != aEnd && m_comp(a->first, b->first))) {
+        if (keepOurs)
+          take(a->first, std::move(value(*a)));
+        ++a;
+      } else if (a == aEnd || m_comp(b->first, a->first)) {
+        if (keepTheirs)
+          take(b->first, other.value(*b));
+        ++b;
+      } else {
+        if (keepBoth) {
+          if (ours || this == &other)
+            take(a->first, std::move(value(*a)));
+          else
+            take(a->first, other.value(*b));
         }
+        ++a;
+        ++b;
       }
-    } else {
-      std::cout << "5" << std::endl;
-      V* val = &m_vals.back();
+    }
 
-      auto checkVal =[this, val](ConstKV kv) {
-        return kv.second == val;
-      };
+    m_keys.swap(keys);
+    m_vals = std::move(vals);
+    m_valOwners = std::move(valOwners);
+    dropRelocation();
+    sorted();
+    if (m_useBloomFilter)
+      buildBloomFilter();
+    m_deepSorted = true;
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  bool BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::saveSnapshot(const std::string& path) {
+    settle();
+    if (!m_deepSorted)
+      deepSort();
+    return snapshot::write<K, V>(path, m_keys.size(),
+                                 [this](size_t i) -> const K& { return m_keys[i].first; },
+                                 m_vals.data());
+  }
 
-      KV& backVal = *std::find_if(m_keys.begin(), m_keys.end(), checkVal);
-      *(it->second) = *backVal.second;
-      it->first = backVal.first;
-      backVal = m_keys.back();
-      m_vals.pop_back();
-      m_keys.pop_back();
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::settle() {
+    mergeInserts();
+    compact();
+    if (!m_sorted)
+      sort();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Q>
+  typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::KeyIt
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::rawLowerBound(const Q& key) {
+    settle();
+    count(bigmapstats::SORTED_SEARCHES);
+    if (!m_searchIndex.empty())
+      return m_keys.begin() + m_searchIndex.lowerBound(key);
+    if constexpr (canInterpolate<Q>()) {
+      if (m_useInterpolation) {
+        const auto range = interpolateRange(m_keys.data(), m_keys.data() + m_keys.size(), key);
+        return std::lower_bound(m_keys.begin() + (range.first - m_keys.data()),
+                                m_keys.begin() + (range.second - m_keys.data()), key, lowerKeyComp());
+      }
     }
-    return true;
+    return std::lower_bound(m_keys.begin(), m_keys.end(), key, lowerKeyComp());
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  typename BigMap<K, V, enforceSortedOnRemove>::iterator BigMap<K, V, enforceSortedOnRemove>::rawFind(const K& key) {
-    const iterator beg = m_keys.begin();
-    const iterator end = m_keys.end();
-    if (m_sorted) {
-      const auto& it = std::lower_bound(beg, end, key, lowerKeyComp);
-      if (it != end && it->first == key)
-        return it;
-      else
-        return end;
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Q>
+  std::pair<typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::iterator,
+            typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::iterator>
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::rawEqualRange(const Q& key) {
+    //Keys are unique, so the upper bound is at most 1 past the lower bound.
+    const KeyIt first = rawLowerBound(key);
+    KeyIt last = first;
+    if (last != m_keys.end() && !m_comp(key, last->first))
+      ++last;
+    return std::make_pair(live(first), live(last));
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  template <typename Q>
+  typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::Range
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::rawRange(const Q& lo, const Q& hi) {
+    const KeyIt first = rawLowerBound(lo);
+    //Everything before first is < lo, so only search from there for hi.
+    const KeyIt last = std::lower_bound(first, m_keys.end(), hi, lowerKeyComp());
+    return range(live(first), live(last));
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  bigmapstats::Stats BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::stats() const {
+    bigmapstats::Stats stats;
+#ifdef BIGMAP_STATS
+    for (size_t i = 0; i < bigmapstats::NUM_COUNTERS; i++) {
+      stats.counts[i] = m_stats.counts[i].load(std::memory_order_relaxed);
     }
+#endif
+    return stats;
+  }
 
-    for (auto it = beg; it != end; it++) {
-      if (unlikely(it->first==key))
-        return it;
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::resetStats() {
+#ifdef BIGMAP_STATS
+    for (std::atomic<u64>& counter : m_stats.counts) {
+      counter.store(0, std::memory_order_relaxed);
     }
+#endif
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::template ZipRange<V>
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::zipped() {
+    settle();
+    if (!m_deepSorted)
+      deepSort();
+    return ZipRange<V>{ZipIterator<V>(m_keys.data(), m_vals.data()),
+                       ZipIterator<V>(m_keys.data() + m_keys.size(), m_vals.data() + m_keys.size())};
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  typename BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::Range
+  BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::range(iterator first, iterator last) {
+    const KV* end = m_keys.data() + std::distance(m_keys.begin(), last.base());
+    return Range{RangeIterator(this, m_keys.data() + std::distance(m_keys.begin(), first.base()), end),
+                 RangeIterator(this, end, end)};
+  }
 
-    return end; //Hope the constness isn't a problem
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::sort() {
+    count(bigmapstats::SORTS);
+    matan::timsort(m_keys.begin(), m_keys.end(), keyComp());
+    keysMoved(0, m_keys.size());
+    sorted();
+    if (m_useBloomFilter)
+      buildBloomFilter(); //drops keys removed since the last build
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  void BigMap<K, V, enforceSortedOnRemove>::sort() {
-    matan::timsort(m_keys.begin(), m_keys.end(), keyComp);
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::sort(ThreadPool& pool) {
+    const size_t n = m_keys.size();
+    const size_t chunks = pool.numThreads();
+    if (chunks < 2 || n < PARALLEL_MIN) {
+      sort();
+      return;
+    }
+    count(bigmapstats::SORTS);
+
+    //First each thread sorts its own chunk of m_keys in place.
+    const auto bound = [n, chunks](size_t c) { return n * c / chunks; };
+    const auto sortChunk = [this, &bound](size_t c) {
+      matan::timsort(m_keys.begin() + bound(c), m_keys.begin() + bound(c+1), keyComp());
+    };
+    for (size_t c = 0; c < chunks; c++) {
+      pool.push_back(sortChunk, c);
+    }
+    pool.waitFinished();
+
+    /*
+     * Then cut the key space into as many parts, at splitters picked from
+     * an even sample of every chunk. Part p of the output is the keys in
+     * [splitter p-1, splitter p) from each chunk, which binary search finds,
+     * so each thread can merge its part straight into its place.
+     */
+    constexpr size_t SAMPLES = 32;
+    std::vector<K> samples;
+    samples.reserve(chunks * SAMPLES);
+    for (size_t c = 0; c < chunks; c++) {
+      for (size_t i = 0; i < SAMPLES; i++) {
+        samples.push_back(m_keys[bound(c) + (bound(c+1) - bound(c)) * i / SAMPLES].first);
+      }
+    }
+    std::sort(samples.begin(), samples.end(), m_comp);
+
+    //cuts[c * (chunks+1) + p] is where part p starts in chunk c.
+    std::vector<size_t> cuts((chunks + 1) * chunks);
+    std::vector<size_t> offsets(chunks + 1, 0);
+    for (size_t c = 0; c < chunks; c++) {
+      cuts[c * (chunks+1)] = bound(c);
+      cuts[c * (chunks+1) + chunks] = bound(c+1);
+      for (size_t p = 1; p < chunks; p++) {
+        const K& splitter = samples[p * samples.size() / chunks];
+        cuts[c * (chunks+1) + p] = std::lower_bound(m_keys.begin() + cuts[c * (chunks+1) + p-1],
+                                                    m_keys.begin() + bound(c+1),
+                                                    splitter,
+                                                    lowerKeyComp()) - m_keys.begin();
+        offsets[p] += cuts[c * (chunks+1) + p] - bound(c);
+      }
+    }
+    offsets[chunks] = n;
+
+    Keys merged(m_keys.get_allocator());
+    merged.reserve(m_keys.capacity());
+    merged.resize(n);
+    const auto mergePart = [this, chunks, &cuts, &offsets, &merged](size_t p) {
+      //Gather the sorted runs from every chunk, timsort merges them.
+      auto out = merged.begin() + offsets[p];
+      for (size_t c = 0; c < chunks; c++) {
+        out = std::copy(m_keys.begin() + cuts[c * (chunks+1) + p],
+                        m_keys.begin() + cuts[c * (chunks+1) + p+1],
+                        out);
+      }
+      matan::timsort(merged.begin() + offsets[p], out, keyComp());
+    };
+    for (size_t p = 0; p < chunks; p++) {
+      pool.push_back(mergePart, p);
+    }
+    pool.waitFinished();
+
+    m_keys.swap(merged);
+    keysMoved(0, n);
+    sorted();
+    if (m_useBloomFilter)
+      buildBloomFilter();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::deepSort(ThreadPool& pool) {
+    const size_t n = m_keys.size();
+    const size_t chunks = pool.numThreads();
+    if (chunks < 2 || n < PARALLEL_MIN) {
+      deepSort();
+      return;
+    }
+    const auto bound = [n, chunks](size_t c) { return n * c / chunks; };
+
+    //Where each chunk's values start in the new m_vals, which dead keys shift down.
+    std::vector<size_t> starts(chunks + 1, 0);
+    const auto countLive = [this, &bound, &starts](size_t c) {
+      starts[c+1] = std::count_if(m_keys.begin() + bound(c), m_keys.begin() + bound(c+1),
+                                  [](const KV& kv) { return !isDead(kv); });
+    };
+    if (m_numDead == 0) {
+      for (size_t c = 0; c <= chunks; c++) {
+        starts[c] = bound(c);
+      }
+    } else {
+      for (size_t c = 0; c < chunks; c++) {
+        pool.push_back(countLive, c);
+      }
+      pool.waitFinished();
+      std::partial_sum(starts.begin(), starts.end(), starts.begin());
+    }
+
+    /*
+     * Unlike gatherVals we can't push_back from several threads, so the
+     * values are default constructed first and then moved over.
+     */
+    Vals sortedVals(m_vals.get_allocator());
+    ValOwners valOwners(m_valOwners.get_allocator());
+    sortedVals.reserve(std::max(m_vals.capacity(), starts[chunks]));
+    sortedVals.resize(starts[chunks]);
+    count(bigmapstats::DEEP_SORTS);
+    count(bigmapstats::VALS_MOVED, starts[chunks]);
+    if constexpr (indexHandles)
+      valOwners.resize(starts[chunks]);
+    const auto gatherChunk = [this, &bound, &starts, &sortedVals, &valOwners](size_t c) {
+      size_t i = starts[c];
+      for (auto it = m_keys.begin() + bound(c); it != m_keys.begin() + bound(c+1); ++it) {
+        if (unlikely(isDead(*it)))
+          continue;
+        sortedVals[i] = std::move(value(*it));
+        if constexpr (indexHandles) {
+          valOwners[i] = it - m_keys.begin();
+          it->second = i;
+        } else {
+          it->second = &sortedVals[i];
+        }
+        ++i;
+      }
+    };
+    for (size_t c = 0; c < chunks; c++) {
+      pool.push_back(gatherChunk, c);
+    }
+    pool.waitFinished();
+
+    m_vals = std::move(sortedVals);
+    m_valOwners = std::move(valOwners);
+    dropRelocation();
+    m_numOrphans = 0;
+    m_deepSorted = (m_numDead == 0);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::mergeInserts() {
+    if (m_buffered == 0)
+      return;
+    //Keys before where the first buffered key goes don't move, so leave them out.
+    const KeyIt buffered = m_keys.end() - m_buffered;
+    const KeyIt from = std::lower_bound(m_keys.begin(), buffered, buffered->first, lowerKeyComp());
+    count(bigmapstats::INSERT_MERGES);
+    matan::timsort(from, m_keys.end(), keyComp());
+    keysMoved(from - m_keys.begin(), m_keys.size());
+    sorted();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::sorted() {
+    m_buffered = 0;
     m_sorted = true;
     m_deepSorted = false;
+    m_hashIndex.clear();
+    if (m_useSearchIndex)
+      buildSearchIndex();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::deepSort() {
+    gatherVals(m_vals.capacity());
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
-  void BigMap<K, V, enforceSortedOnRemove>::deepSort() {
-    std::vector<V> sortedVals;
-    sortedVals.reserve(m_vals.size());
-    for (const auto& it : m_keys) {
-      sortedVals.push_back(*it.second);
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::gatherVals(size_t capacity) {
+    /*
+     * Dead keys keep their place in m_keys but their values are dropped,
+     * so until compact() removes the keys too, we aren't really deep sorted.
+     */
+    Vals sortedVals(m_vals.get_allocator());
+    ValOwners valOwners(m_valOwners.get_allocator());
+    sortedVals.reserve(std::max(capacity, m_keys.size() - m_numDead));
+    count(bigmapstats::DEEP_SORTS);
+    count(bigmapstats::VALS_MOVED, m_keys.size() - m_numDead);
+    if constexpr (indexHandles)
+      valOwners.reserve(sortedVals.capacity());
+    for (KV& kv : m_keys) {
+      if (unlikely(isDead(kv)))
+        continue;
+      sortedVals.push_back(std::move(value(kv)));
+      if constexpr (indexHandles) {
+        valOwners.push_back(&kv - m_keys.data());
+        kv.second = sortedVals.size() - 1;
+      } else {
+        kv.second = &sortedVals.back(); //reserved, so no reallocation and still good after the move
+      }
+    }
+    m_vals = std::move(sortedVals);
+    m_valOwners = std::move(valOwners);
+    dropRelocation();
+    m_numOrphans = 0;
+    m_deepSorted = (m_numDead == 0);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::incrementalDeepSort(size_t step) {
+    static_assert(!indexHandles, "index handles never gather values when m_vals grows");
+    m_relocStep = step;
+    if (step == 0)
+      finishRelocating();
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::startRelocating() {
+    m_relocVals.reserve(2 * m_vals.size() + 1);
+    m_relocLeft = m_keys.size() - m_numDead;
+    m_relocCursor = 0;
+    m_deepSorted = false;
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::relocate(size_t most) {
+    if constexpr (!indexHandles) {
+      //Bound how many keys we look at too, most of them may already have been moved.
+      size_t moved = 0;
+      for (size_t looked = 0; moved < most && moved < m_relocLeft && looked < 4 * most; looked++) {
+        if (m_relocCursor >= m_keys.size())
+          m_relocCursor = 0;
+        KV& kv = m_keys[m_relocCursor++];
+        if (isDead(kv) || !inOldVals(kv))
+          continue;
+        m_relocVals.push_back(std::move(value(kv)));
+        kv.second = &m_relocVals.back();
+        ++moved;
+      }
+      relocated(moved);
+    }
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::relocated(size_t n) {
+    m_relocLeft -= n;
+    if (m_relocLeft == 0 && n != 0) {
+      m_vals = std::move(m_relocVals);
+      dropRelocation();
     }
-    m_vals = std::move(sortedVals); //should this be a move?
-    m_deepSorted = true;
   }
 
-  template <typename K, typename V, bool enforceSortedOnRemove>
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::finishRelocating() {
+    if (m_relocLeft == 0)
+      return;
+    //Only short on room if this is a copy, which doesn't keep capacity.
+    if (m_relocVals.capacity() - m_relocVals.size() < m_relocLeft)
+      gatherVals(m_relocVals.capacity());
+    else
+      while (m_relocLeft != 0)
+        relocate(m_relocLeft);
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::dropRelocation() {
+    m_relocVals.clear();
+    m_relocVals.shrink_to_fit();
+    m_relocLeft = 0;
+    m_relocCursor = 0;
+  }
+
+  template <typename K, typename V, bool enforceSortedOnRemove, bool indexHandles, typename Compare, typename Alloc>
   template <typename IterK, typename IterV>
-  void BigMap<K, V, enforceSortedOnRemove>::zipAppend(const IterK& keys, const IterV& vals) {
+  void BigMap<K, V, enforceSortedOnRemove, indexHandles, Compare, Alloc>::zipAppend(const IterK& keys, const IterV& vals) {
     BOOST_FOREACH(const auto kv, boost::combine(keys, vals)) {
-      if (!(replace(boost::get<0>(kv), boost::get<1>(kv))))
-        rawAppend(boost::get<0>(kv), boost::get<1>(kv));
+      rawAppend(boost::get<0>(kv), boost::get<1>(kv));
     }
   }
 } //namespace matan
-
-#undef unlikely
-#undef likely
@@ -0,0 +1,132 @@
+/*
+ * Blocked Bloom filter, for saying a key is definitely not in some other
+ * array without looking at the array. Each key only touches 1 block of 256
+ * bits (half a cache line), so a lookup is a single cache miss at most. The
+ * block is split into 8 32 bit lanes and the key sets 1 bit in each, which
+ * with AVX2 is a handful of instructions to build the mask and 1 test of
+ * the whole block against it.
+ *
+ * Like HashIndex there is no erase, so a key that's gone just keeps its
+ * bits until the owner rebuilds. Past the number of keys it was built for
+ * the false positive rate climbs, so insert says when it's time to rebuild.
+ *
+ * Lookups take keys of another type Q, hashed with Hash if it takes a Q,
+ * else std::hash<Q>, same as HashIndex.
+ */
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <algorithm>
+#include <cstddef>
+#include "general.hh"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace matan {
+
+template <typename K, typename Hash=std::hash<K>>
+class BloomFilter {
+public:
+  //~0.2% false positives at capacity.
+  static constexpr size_t BITS_PER_KEY = 16;
+
+  template <typename Q>
+  bool mayContain(const Q& key) const;
+
+  //True once there are more keys than it was built for, time to rebuild. No-op if never built.
+  bool insert(const K& key);
+
+  /*
+   * keyAt(i) must return the i'th of the n keys. Leaves room for as many
+   * keys again before insert asks for a rebuild.
+   */
+  template <typename KeyAt>
+  void build(size_t n, const KeyAt& keyAt);
+
+  void clear() { m_blocks.clear(); m_size = 0; m_capacity = 0; }
+  bool empty() const { return m_blocks.empty(); }
+  size_t size() const { return m_size; }
+
+private:
+  struct alignas(32) Block {
+    u32 lanes[8];
+  };
+  //Odd constants to spread the hash over each lane's 32 bits, from Impala's filter.
+  static constexpr u32 SALTS[8] = {0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+                                   0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u};
+
+  //Scrambled (see scrambleHash), the high half picks the block and the low half the bits.
+  template <typename Q>
+  u64 hashOf(const Q& key) const {
+    u64 hash;
+    if constexpr (std::is_invocable<const Hash&, const Q&>::value)
+      hash = m_hash(key);
+    else
+      hash = std::hash<Q>()(key);
+    return scrambleHash(hash);
+  }
+  const Block& blockOf(u64 hash) const { return m_blocks[((hash >> 32) * m_blocks.size()) >> 32]; }
+  Block& blockOf(u64 hash) { return m_blocks[((hash >> 32) * m_blocks.size()) >> 32]; }
+  void set(u64 hash);
+
+  std::vector<Block> m_blocks;
+  size_t m_size = 0;
+  size_t m_capacity = 0;
+  Hash m_hash;
+};
+
+template <typename K, typename Hash>
+template <typename Q>
+bool BloomFilter<K, Hash>::mayContain(const Q& key) const {
+  if (m_blocks.empty())
+    return true;
+  const u64 hash = hashOf(key);
+  const Block& block = blockOf(hash);
+#if defined(__AVX2__)
+  const __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(u32(hash)),
+                                                            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(SALTS))),
+                                         27);
+  const __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+  //testc is 1 if every bit of mask is set in the block.
+  return _mm256_testc_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(block.lanes)), mask);
+#else
+  for (size_t i = 0; i < 8; i++) {
+    if ((block.lanes[i] & (u32(1) << ((u32(hash) * SALTS[i]) >> 27))) == 0)
+      return false;
+  }
+  return true;
+#endif
+}
+
+template <typename K, typename Hash>
+void BloomFilter<K, Hash>::set(u64 hash) {
+  Block& block = blockOf(hash);
+  for (size_t i = 0; i < 8; i++) {
+    block.lanes[i] |= u32(1) << ((u32(hash) * SALTS[i]) >> 27);
+  }
+}
+
+template <typename K, typename Hash>
+bool BloomFilter<K, Hash>::insert(const K& key) {
+  if (unlikely(m_blocks.empty()))
+    return false;
+  set(hashOf(key));
+  return ++m_size > m_capacity;
+}
+
+template <typename K, typename Hash>
+template <typename KeyAt>
+void BloomFilter<K, Hash>::build(size_t n, const KeyAt& keyAt) {
+  m_capacity = std::max<size_t>(2 * n, 64);
+  m_blocks.assign((m_capacity * BITS_PER_KEY + 255) / 256, Block{});
+  for (size_t i = 0; i < n; i++) {
+    set(hashOf(keyAt(i)));
+  }
+  m_size = n;
+}
+
+} // matan
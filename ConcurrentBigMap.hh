@@ -0,0 +1,240 @@
+/*
+ * BigMap for 1 writer and any number of readers, without readers ever
+ * waiting on the writer (or each other).
+ *
+ * The writer makes its changes to a private BigMap, and publish() puts out
+ * a sorted, deep sorted copy of it as the new version. Versions are never
+ * changed once published, so readers just pin whichever version is current
+ * and search it like any other const BigMap.
+ *
+ * Old versions are freed with epoch based reclamation. Every reader has its
+ * own slot (a cache line each, so pinning never bounces a line between
+ * readers) where it posts the epoch it pinned at. A version retired at epoch
+ * E is freed once no slot holds an epoch before E, which is checked on each
+ * publish().
+ *
+ *   ConcurrentBigMap<long, Order> orders;
+ *   //writer thread
+ *   orders.append(id, order); orders.publish();
+ *   //reader thread
+ *   auto reader = orders.reader();
+ *   auto snapshot = reader.snapshot();
+ *   const Order* order = snapshot.find(id);
+ */
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cassert>
+
+#include "BigMap.hh"
+#include "general.hh"
+
+namespace matan {
+  template <typename K, typename V, size_t MAX_READERS=64>
+  class ConcurrentBigMap {
+  public:
+    //Index handles, so that copying a map to publish it doesn't need pointer fix ups.
+    typedef BigMap<K, V, true, true> Map;
+    typedef typename Map::KV KV;
+    typedef typename Map::const_iterator const_iterator;
+
+  private:
+    static constexpr u64 IDLE = u64(-1);
+    struct alignas(64) Slot {
+      std::atomic<u64> epoch{IDLE};
+      std::atomic<bool> taken{false};
+    };
+
+  public:
+    /*
+     * A pinned version. Everything in it stays valid, and unchanged, until
+     * the Snapshot goes away, no matter how many versions get published in
+     * the meantime. So keep them short lived, since they hold back freeing
+     * every version from this one on.
+     */
+    class Snapshot {
+    public:
+      Snapshot(Snapshot&& other) noexcept : m_slot(other.m_slot), m_map(other.m_map) {
+        other.m_slot = nullptr;
+      }
+      Snapshot(const Snapshot&) = delete;
+      Snapshot& operator=(const Snapshot&) = delete;
+      ~Snapshot() {
+        if (m_slot != nullptr)
+          m_slot->epoch.store(IDLE, std::memory_order_release);
+      }
+
+      const Map& map() const { return *m_map; }
+      size_t size() const { return m_map->size(); }
+      const_iterator begin() const { return m_map->begin(); }
+      const_iterator end() const { return m_map->end(); }
+      const V& value(const KV& kv) const { return m_map->value(kv); }
+
+      //nullptr if key isn't there.
+      const V* find(const K& key) const {
+        const const_iterator it = m_map->find(key);
+        return it == m_map->end() ? nullptr : &m_map->value(*it);
+      }
+      //Versions are always sorted, so no need to settle like BigMap does.
+      const_iterator lower_bound(const K& key) const { return lowerBound(begin(), key); }
+      //The keys in [lo, hi).
+      std::pair<const_iterator, const_iterator> range(const K& lo, const K& hi) const {
+        const const_iterator first = lower_bound(lo);
+        return std::make_pair(first, lowerBound(first, hi));
+      }
+
+    private:
+      /*
+       * Map iterators only step 1 key at a time, but versions have no dead
+       * keys, so binary search the keys underneath them.
+       */
+      const_iterator lowerBound(const const_iterator& first, const K& key) const {
+        const auto last = m_map->end().base();
+        return const_iterator(std::lower_bound(first.base(), last, key,
+                                               [](const KV& kv, const K& k) { return kv.first < k; }),
+                              last);
+      }
+
+      friend class ConcurrentBigMap;
+      Snapshot(Slot* slot, const Map* map) : m_slot(slot), m_map(map) {}
+      Slot* m_slot;
+      const Map* m_map;
+    };
+
+    /*
+     * A reader's claim on a slot, 1 per reader thread. A Reader can only
+     * have 1 Snapshot at a time. If all MAX_READERS slots are taken, making
+     * a Reader waits for one to be given back.
+     */
+    class Reader {
+    public:
+      Reader(Reader&& other) noexcept : m_owner(other.m_owner), m_slot(other.m_slot) {
+        other.m_slot = nullptr;
+      }
+      Reader(const Reader&) = delete;
+      Reader& operator=(const Reader&) = delete;
+      ~Reader() {
+        if (m_slot != nullptr)
+          m_slot->taken.store(false, std::memory_order_release);
+      }
+
+      Snapshot snapshot() const { return m_owner->pin(m_slot); }
+
+    private:
+      friend class ConcurrentBigMap;
+      Reader(const ConcurrentBigMap* owner, Slot* slot) : m_owner(owner), m_slot(slot) {}
+      const ConcurrentBigMap* m_owner;
+      Slot* m_slot;
+    };
+
+    ConcurrentBigMap();
+    ConcurrentBigMap(const ConcurrentBigMap&) = delete;
+    ConcurrentBigMap& operator=(const ConcurrentBigMap&) = delete;
+    ~ConcurrentBigMap(); //No Readers may be left.
+
+    Reader reader();
+
+    /*
+     * The writer's side, only ever from 1 thread at a time. Changes aren't
+     * seen by readers until publish().
+     */
+    void append(const K& key, const V& val) { m_next.append(key, val); }
+    void append(const std::pair<K, V>& kv) { m_next.append(kv); }
+    template <typename Iter>
+    void batchAppend(const Iter& pairs) { m_next.batchAppend(pairs); }
+    bool remove(const K& key) { return m_next.remove(key); }
+    const Map& pending() const { return m_next; } //what the next publish() will put out
+    void publish();
+    void reclaim(); //free what no reader can see anymore, publish() does this too
+
+  private:
+    Snapshot pin(Slot* slot) const;
+
+    Map m_next;
+    std::atomic<const Map*> m_current;
+    std::atomic<u64> m_epoch{0};
+    std::vector<std::pair<const Map*, u64>> m_retired; //version, epoch it was retired at
+    Slot m_slots[MAX_READERS];
+  };
+
+  template <typename K, typename V, size_t MAX_READERS>
+  ConcurrentBigMap<K, V, MAX_READERS>::ConcurrentBigMap() : m_current(new Map()) {
+    /*
+     * Appends land anywhere, and removes should be cheap since we'll
+     * compact everything before publishing anyways. Readers get the search
+     * index, since a version is only ever read.
+     */
+    if constexpr (IsHashable<K>::value)
+      m_next.useHashIndex();
+    m_next.lazyRemove(0.5);
+    m_next.useSearchIndex();
+  }
+
+  template <typename K, typename V, size_t MAX_READERS>
+  ConcurrentBigMap<K, V, MAX_READERS>::~ConcurrentBigMap() {
+    delete m_current.load();
+    for (const auto& retired : m_retired) {
+      delete retired.first;
+    }
+  }
+
+  template <typename K, typename V, size_t MAX_READERS>
+  typename ConcurrentBigMap<K, V, MAX_READERS>::Reader
+  ConcurrentBigMap<K, V, MAX_READERS>::reader() {
+    while (true) {
+      for (Slot& slot : m_slots) {
+        bool expected = false;
+        if (!slot.taken.load(std::memory_order_relaxed) &&
+            slot.taken.compare_exchange_strong(expected, true, std::memory_order_acquire))
+          return Reader(this, &slot);
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  template <typename K, typename V, size_t MAX_READERS>
+  typename ConcurrentBigMap<K, V, MAX_READERS>::Snapshot
+  ConcurrentBigMap<K, V, MAX_READERS>::pin(Slot* slot) const {
+    assert(slot->epoch.load(std::memory_order_relaxed) == IDLE);
+    /*
+     * Post the epoch before loading the version. Either the writer sees our
+     * epoch when it looks to free this version, or we load after it
+     * swapped the version out, and so get the new one. (Both are seq_cst,
+     * which is what orders the store before the load.)
+     */
+    slot->epoch.store(m_epoch.load());
+    return Snapshot(slot, m_current.load());
+  }
+
+  template <typename K, typename V, size_t MAX_READERS>
+  void ConcurrentBigMap<K, V, MAX_READERS>::publish() {
+    m_next.compact();
+    m_next.sort();
+    if (!m_next.isDeepSorted())
+      m_next.deepSort();
+    const Map* old = m_current.exchange(new Map(m_next));
+    m_retired.emplace_back(old, m_epoch.fetch_add(1) + 1);
+    reclaim();
+  }
+
+  template <typename K, typename V, size_t MAX_READERS>
+  void ConcurrentBigMap<K, V, MAX_READERS>::reclaim() {
+    //Anything retired at or before the oldest pinned epoch is out of reach.
+    u64 oldest = IDLE;
+    for (const Slot& slot : m_slots) {
+      oldest = std::min(oldest, slot.epoch.load());
+    }
+    auto freeable = [oldest](const std::pair<const Map*, u64>& retired) {
+      if (retired.second > oldest)
+        return false;
+      delete retired.first;
+      return true;
+    };
+    m_retired.erase(std::remove_if(m_retired.begin(), m_retired.end(), freeable),
+                    m_retired.end());
+  }
+} //namespace matan
@@ -0,0 +1,131 @@
+/*
+ * Read optimized copy of a sorted sequence of keys, laid out in Eytzinger
+ * (BFS) order. The root is at index 1 and the children of k are at 2k and
+ * 2k+1, so the first few levels of every search share the same handful of
+ * cache lines, and each step down the tree is a single multiply-add with no
+ * hard to predict branch.
+ *
+ * The children of k, 4 levels down, live next to each other starting at
+ * 16k. So while comparing against k we prefetch that block, which means
+ * by the time we get there it's (hopefully) already in cache.
+ *
+ * This only stores a copy of the keys + their rank in the original sequence.
+ * It's up to the owner to rebuild it whenever the original changes.
+ *
+ * Compare is what the original is sorted by. If it's transparent (like
+ * std::less<>) searches take anything it can compare to a K.
+ */
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cstddef>
+#include "general.hh"
+
+namespace matan {
+
+template <typename K, typename Compare=std::less<K>>
+class EytzingerIndex {
+public:
+  explicit EytzingerIndex(const Compare& comp=Compare()) : m_comp(comp) {}
+
+  /*
+   * [first, last) must already be sorted. getKey extracts the key from
+   * whatever the iterator points to (ie. the pair in BigMap).
+   */
+  template <typename Iter, typename GetKey>
+  void build(Iter first, Iter last, GetKey getKey);
+
+  void clear() { m_keys.clear(); m_ranks.clear(); }
+  bool empty() const { return m_keys.size() <= 1; }
+
+  /*
+   * Rank, in the sequence we were built from, of the first key that is not
+   * less than key. If every key is less, returns the size of the sequence,
+   * just like std::lower_bound would return last.
+   */
+  template <typename Q>
+  size_t lowerBound(const Q& key) const { return rank(descend(key)); }
+
+  /*
+   * Rank of key in the sequence we were built from, or the size of the
+   * sequence if it isn't there. Cheaper than lowerBound when we only care
+   * about exact matches, since a miss never touches m_ranks.
+   */
+  template <typename Q>
+  size_t find(const Q& key) const {
+    const size_t k = descend(key);
+    return (k != 0 && !m_comp(key, m_keys[k])) ? m_ranks[k] : size();
+  }
+
+  size_t size() const { return m_keys.empty() ? 0 : m_keys.size() - 1; }
+
+private:
+  //Descendants of k, this many apart, fit in a single cache line.
+  static constexpr size_t PREFETCH_STRIDE =
+    sizeof(K) >= 64 ? 1 :
+    sizeof(K) > 32 ? 2 :
+    sizeof(K) > 16 ? 4 :
+    sizeof(K) > 8 ? 8 : 64 / sizeof(K);
+
+  template <typename Q>
+  size_t descend(const Q& key) const; //Eytzinger index of the lower bound, 0 if none.
+  size_t rank(size_t k) const { return k == 0 ? size() : m_ranks[k]; }
+
+  template <typename Iter, typename GetKey>
+  void fill(Iter& it, GetKey& getKey, size_t& rank, size_t k);
+
+  std::vector<K> m_keys; //1 based, m_keys[0] is never looked at.
+  std::vector<size_t> m_ranks;
+  Compare m_comp;
+};
+
+template <typename K, typename Compare>
+template <typename Iter, typename GetKey>
+void EytzingerIndex<K, Compare>::build(Iter first, Iter last, GetKey getKey) {
+  const size_t n = std::distance(first, last);
+  clear();
+  if (n == 0)
+    return;
+  m_keys.resize(n+1);
+  m_ranks.resize(n+1);
+  size_t rank = 0;
+  fill(first, getKey, rank, 1);
+}
+
+template <typename K, typename Compare>
+template <typename Iter, typename GetKey>
+void EytzingerIndex<K, Compare>::fill(Iter& it, GetKey& getKey, size_t& rank, size_t k) {
+  //In order traversal of the implicit tree, so we visit the keys in sorted order.
+  if (k >= m_keys.size())
+    return;
+  fill(it, getKey, rank, 2*k);
+  m_keys[k] = getKey(*it);
+  m_ranks[k] = rank;
+  ++it;
+  ++rank;
+  fill(it, getKey, rank, 2*k+1);
+}
+
+template <typename K, typename Compare>
+template <typename Q>
+size_t EytzingerIndex<K, Compare>::descend(const Q& key) const {
+  const size_t n = size();
+
+  const K* keys = m_keys.data();
+  size_t k = 1;
+  while (k <= n) {
+    __builtin_prefetch(keys + std::min(k * PREFETCH_STRIDE, n));
+    k = 2*k + m_comp(keys[k], key);
+  }
+  /*
+   * Every right turn appended a 1 to k, so the last left turn we took is
+   * the lowest 0 bit. Undo everything after it (and the turn itself) to
+   * get the node we turned left at, which is the lower bound. If we never
+   * turned left, k becomes 0 and every key was less than the one we want.
+   */
+  return k >> __builtin_ffsll(~k);
+}
+
+} // matan
@@ -0,0 +1,132 @@
+/*
+ * Open addressing (linear probing) hash table from a key to its position in
+ * some other array. It doesn't hold the keys themselves, only a 32 bit hash
+ * and the position, so it stays small and the owner doesn't have to keep 2
+ * copies of every key. The price is that lookups need a way to get the key
+ * at a position to confirm a match, which is only done when the stored hash
+ * matches.
+ *
+ * There is no erase. Positions are expected to only ever be appended to,
+ * anything else (sorting, removing) should just rebuild the index.
+ *
+ * find also takes keys of another type Q, which have to == the K they
+ * stand for. They're hashed with Hash if it takes a Q, else std::hash<Q>,
+ * which is right for string_view lookups of string keys since the
+ * standard has them hash the same.
+ */
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <cstddef>
+#include <cassert>
+#include "general.hh"
+
+namespace matan {
+
+template <typename K, typename Hash=std::hash<K>>
+class HashIndex {
+public:
+  static constexpr size_t npos = size_t(-1);
+
+  /*
+   * keyAt(i) must return the key at position i of the indexed array.
+   */
+  template <typename Q, typename KeyAt>
+  size_t find(const Q& key, const KeyAt& keyAt) const;
+
+  //key must not already be in the index.
+  void insert(const K& key, size_t pos);
+
+  template <typename KeyAt>
+  void build(size_t n, const KeyAt& keyAt);
+
+  void clear() { m_slots.clear(); m_size = 0; }
+  size_t size() const { return m_size; }
+
+private:
+  static constexpr u32 EMPTY = u32(-1);
+  struct Slot {
+    u32 hash;
+    u32 pos;
+  };
+
+  //Scrambled (see scrambleHash), linear probing clusters terribly on strided keys.
+  template <typename Q>
+  u32 hashOf(const Q& key) const {
+    u64 hash;
+    if constexpr (std::is_invocable<const Hash&, const Q&>::value)
+      hash = m_hash(key);
+    else
+      hash = std::hash<Q>()(key);
+    return u32(scrambleHash(hash) >> 32);
+  }
+  void place(u32 hash, u32 pos);
+  void grow();
+
+  std::vector<Slot> m_slots; //size is always 0 or a power of 2
+  size_t m_size = 0;
+  Hash m_hash;
+};
+
+template <typename K, typename Hash>
+template <typename Q, typename KeyAt>
+size_t HashIndex<K, Hash>::find(const Q& key, const KeyAt& keyAt) const {
+  if (m_slots.empty())
+    return npos;
+  const size_t mask = m_slots.size() - 1;
+  const u32 hash = hashOf(key);
+  for (size_t i = hash & mask; ; i = (i+1) & mask) {
+    const Slot& slot = m_slots[i];
+    if (slot.pos == EMPTY)
+      return npos;
+    if (slot.hash == hash && keyAt(slot.pos) == key)
+      return slot.pos;
+  }
+}
+
+template <typename K, typename Hash>
+void HashIndex<K, Hash>::insert(const K& key, size_t pos) {
+  assert(pos < EMPTY);
+  if (unlikely(2 * (m_size + 1) > m_slots.size()))
+    grow();
+  place(hashOf(key), pos);
+  ++m_size;
+}
+
+template <typename K, typename Hash>
+template <typename KeyAt>
+void HashIndex<K, Hash>::build(size_t n, const KeyAt& keyAt) {
+  clear();
+  size_t capacity = 16;
+  while (capacity < 2 * n)
+    capacity <<= 1;
+  m_slots.assign(capacity, Slot{0, EMPTY});
+  for (size_t i = 0; i < n; i++) {
+    place(hashOf(keyAt(i)), i);
+  }
+  m_size = n;
+}
+
+template <typename K, typename Hash>
+void HashIndex<K, Hash>::place(u32 hash, u32 pos) {
+  const size_t mask = m_slots.size() - 1;
+  size_t i = hash & mask;
+  while (m_slots[i].pos != EMPTY)
+    i = (i+1) & mask;
+  m_slots[i] = Slot{hash, pos};
+}
+
+template <typename K, typename Hash>
+void HashIndex<K, Hash>::grow() {
+  //We kept the hashes, so no need to look at the keys again.
+  std::vector<Slot> old(m_slots.empty() ? 16 : 2 * m_slots.size(), Slot{0, EMPTY});
+  old.swap(m_slots);
+  for (const Slot& slot : old) {
+    if (slot.pos != EMPTY)
+      place(slot.hash, slot.pos);
+  }
+}
+
+} // matan
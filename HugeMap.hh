@@ -0,0 +1,371 @@
+/*
+ * The big brother of BigMap, for values so big (KBs) that moving them at all
+ * is what costs us. BigMap keeps its values in a vector, so they get copied
+ * on every reallocation, on deepSort, and remove shifts them over. Here the
+ * values live in fixed size chunks that never move once allocated, and
+ * removed values' slots are reused for new ones. Only the (K, V*) array is
+ * ever sorted, merged or shifted.
+ *
+ * The price is that values aren't in key order, and there is no deepSort to
+ * put them there, so iterating over the values is a pointer chase per key.
+ * If you iterate a lot more than you insert/remove, BigMap is the better bet.
+ *
+ * The API is otherwise the same as BigMap's, and pointers to values stay
+ * good until that key is removed.
+ */
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <initializer_list>
+
+#include <boost/foreach.hpp>
+#include <boost/range/combine.hpp>
+
+#include "timsort.hh"
+#include "KeyScan.hh"
+#include "general.hh"
+
+namespace matan {
+
+  /*
+   * Slab of Vs. Memory is handed out in chunks of CHUNK_VALS slots which are
+   * never freed or moved until the pool is destroyed. Free slots form a linked
+   * list through the slots themselves, so destroy + create reuses the most
+   * recently freed (and likely still cached) slot.
+   *
+   * The pool doesn't know which slots are live, so whoever owns it has to
+   * destroy every value it created before the pool goes away.
+   */
+  template <typename V>
+  class ValuePool {
+  public:
+    //Around 64KB per chunk, but at least 1 value.
+    static constexpr size_t CHUNK_VALS = sizeof(V) >= (1 << 16) ? 1 : (1 << 16) / sizeof(V);
+
+    ValuePool() = default;
+    ValuePool(const ValuePool&) = delete;
+    ValuePool& operator=(const ValuePool&) = delete;
+    ValuePool(ValuePool&& other) noexcept :
+      m_chunks(std::move(other.m_chunks)), m_free(other.m_free) {
+      other.m_free = nullptr;
+    }
+    ValuePool& operator=(ValuePool&& other) noexcept {
+      m_chunks = std::move(other.m_chunks);
+      m_free = other.m_free;
+      other.m_free = nullptr;
+      return *this;
+    }
+
+    template <typename... Args>
+    V* create(Args&&... args);
+    void destroy(V* val);
+    void reserve(size_t n);
+    size_t capacity() const { return m_chunks.size() * CHUNK_VALS; }
+
+  private:
+    union Slot {
+      Slot* next;
+      alignas(V) unsigned char bytes[sizeof(V)];
+    };
+    void addChunk();
+
+    std::vector<std::unique_ptr<Slot[]>> m_chunks;
+    Slot* m_free = nullptr;
+  };
+
+  template <typename V>
+  template <typename... Args>
+  V* ValuePool<V>::create(Args&&... args) {
+    if (unlikely(m_free == nullptr))
+      addChunk();
+    Slot* slot = m_free;
+    m_free = slot->next;
+    V* val = reinterpret_cast<V*>(slot->bytes);
+    place(val, std::forward<Args>(args)...);
+    return val;
+  }
+
+  template <typename V>
+  void ValuePool<V>::destroy(V* val) {
+    val->~V();
+    Slot* slot = reinterpret_cast<Slot*>(val);
+    slot->next = m_free;
+    m_free = slot;
+  }
+
+  template <typename V>
+  void ValuePool<V>::reserve(size_t n) {
+    while (capacity() < n)
+      addChunk();
+  }
+
+  template <typename V>
+  void ValuePool<V>::addChunk() {
+    //Thread the new slots onto the front of the free list, in address order.
+    Slot* chunk = new Slot[CHUNK_VALS];
+    m_chunks.emplace_back(chunk);
+    for (size_t i = CHUNK_VALS; i-- > 0; ) {
+      chunk[i].next = m_free;
+      m_free = chunk + i;
+    }
+  }
+
+  template <typename K, typename V>
+  class HugeMap {
+  public:
+    typedef std::pair<K, V*> KV;
+    typedef typename std::vector<KV>::iterator iterator;
+    typedef typename std::vector<KV>::const_iterator const_iterator;
+    typedef typename std::vector<KV>::reverse_iterator reverse_iterator;
+    typedef typename std::vector<KV>::const_reverse_iterator const_reverse_iterator;
+
+  private:
+    std::vector<KV> m_keys;
+    ValuePool<V> m_vals;
+    bool m_sorted = true;
+
+    size_t findIndex(const K& key) const; //m_keys.size() if not found
+    iterator rawFind(const K& key) { return m_keys.begin() + findIndex(key); }
+    const_iterator rawFind(const K& key) const { return m_keys.begin() + findIndex(key); }
+
+    //Val is V, const V& or V&&, so that values handed over as rvalues are moved in.
+    template <bool noReplace=false, typename Val>
+    void rawAppend(const K& key, Val&& val);
+    void rawAppend(const std::pair<const K, const V>& kv) { rawAppend(kv.first, kv.second); }
+    template <typename Val>
+    void rawInsert(const K& key, Val&& val);
+
+    template <typename Val>
+    bool replace(const K& key, Val&& val);
+
+    static bool lowerKeyComp(const KV& a, const K& b) { return a.first < b; };
+    static bool keyComp(const KV& a, const KV& b) { return a.first < b.first; };
+  public:
+    HugeMap() = default;
+    HugeMap(const int n) { reserve(n); }
+
+    template <typename Iter>
+    HugeMap(const Iter& pairs);
+
+    template <typename IterK, typename IterV>
+    HugeMap(const IterK& keys, const IterV& vals);
+
+    HugeMap(const HugeMap& other);
+    HugeMap(HugeMap&& other) noexcept = default;
+    HugeMap& operator=(HugeMap other) noexcept;
+    ~HugeMap();
+
+    iterator begin() { return m_keys.begin(); }
+    const_iterator begin() const { return m_keys.begin(); }
+    iterator end() { return m_keys.end(); }
+    const_iterator end() const { return m_keys.end(); }
+    reverse_iterator rbegin() { return m_keys.rbegin(); }
+    const_reverse_iterator rbegin() const  { return m_keys.rbegin(); }
+    reverse_iterator rend() { return m_keys.rend(); }
+    const_reverse_iterator rend() const { return m_keys.rend(); }
+
+    V& value(const KV& kv) { return *kv.second; }
+    const V& value(const KV& kv) const { return *kv.second; }
+
+    size_t size() const { return m_keys.size(); }
+    bool isSorted() const { return m_sorted; }
+    iterator find(const K& key) { return rawFind(key); }
+    const_iterator find(const K& key) const { return rawFind(key); }
+    V& operator[](const K& key);
+    void reserve(const int n) { m_keys.reserve(n); m_vals.reserve(n); }
+
+    void insert(const K& key, const V& val) { rawInsert(key, val); }
+    void insert(const K& key, V&& val) { rawInsert(key, std::move(val)); }
+    void insert(const std::pair<const K, const V>& kv) { insert(kv.first, kv.second); }
+
+    //See BigMap for append vs insert.
+    template <typename Iter>
+    void batchInsert(const Iter& pairs);
+    void batchInsert(const std::initializer_list<std::pair<K, V>>&& pairs);
+    template <typename IterK, typename IterV>
+    void batchInsert(const IterK& keys, const IterV& vals);
+
+    void append(const K& key, const V& val) { rawAppend(key, val); }
+    void append(const K& key, V&& val) { rawAppend(key, std::move(val)); }
+    void append(const std::pair<K, V>& kv) { append(kv.first, kv.second); };
+
+    template <typename Iter>
+    void batchAppend(const Iter& pairs);
+    void batchAppend(const std::initializer_list<std::pair<K, V>>&& pairs);
+    template <typename IterK, typename IterV>
+    void batchAppend(const IterK& keys, const IterV& vals);
+
+    /*
+     * Only the keys shift (or with an unsorted map the last key moves into
+     * the hole), the value is destroyed in place and its slot reused.
+     */
+    bool remove(const K& key);
+    void sort(); //sort the keys, values never move
+  };
+
+  template <typename K, typename V>
+  template <typename Iter>
+  HugeMap<K, V>::HugeMap(const Iter& pairs) {
+    reserve(pairs.size());
+    batchInsert(pairs);
+  }
+
+  template <typename K, typename V>
+  template <typename IterK, typename IterV>
+  HugeMap<K, V>::HugeMap(const IterK& keys, const IterV& vals) {
+    reserve(keys.size());
+    batchInsert(keys, vals);
+  }
+
+  template <typename K, typename V>
+  HugeMap<K, V>::HugeMap(const HugeMap& other) : m_sorted(other.m_sorted) {
+    reserve(other.size());
+    for (const KV& kv : other.m_keys) {
+      m_keys.push_back(KV(kv.first, m_vals.create(*kv.second)));
+    }
+  }
+
+  template <typename K, typename V>
+  HugeMap<K, V>& HugeMap<K, V>::operator=(HugeMap other) noexcept {
+    std::swap(m_keys, other.m_keys);
+    std::swap(m_vals, other.m_vals);
+    std::swap(m_sorted, other.m_sorted);
+    return *this;
+  }
+
+  template <typename K, typename V>
+  HugeMap<K, V>::~HugeMap() {
+    for (KV& kv : m_keys) {
+      m_vals.destroy(kv.second);
+    }
+  }
+
+  template <typename K, typename V>
+  V& HugeMap<K, V>::operator[](const K& key) {
+    iterator it = rawFind(key);
+    if (it != end())
+      return *it->second;
+    if (m_sorted) {
+      insert(key, V());
+      return *rawFind(key)->second;
+    }
+    rawAppend<true>(key, V());
+    return *m_keys.back().second;
+  }
+
+  template <typename K, typename V>
+  template <typename Val>
+  void HugeMap<K, V>::rawInsert(const K& key, Val&& val) {
+    if (replace(key, std::forward<Val>(val))) {
+      if (!m_sorted)
+        sort();
+    } else if (!m_sorted) {
+      m_keys.push_back(KV(key, m_vals.create(std::forward<Val>(val))));
+      sort();
+    } else {
+      m_keys.insert(std::lower_bound(m_keys.begin(), m_keys.end(), key, lowerKeyComp),
+                    KV(key, m_vals.create(std::forward<Val>(val))));
+    }
+  }
+
+  template <typename K, typename V>
+  template <typename Iter>
+  void HugeMap<K, V>::batchInsert(const Iter& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+    sort();
+  }
+
+  template <typename K, typename V>
+  void HugeMap<K, V>::batchInsert(const std::initializer_list<std::pair<K, V>>&& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+    sort();
+  }
+
+  template <typename K, typename V>
+  template <typename IterK, typename IterV>
+  void HugeMap<K, V>::batchInsert(const IterK& keys, const IterV& vals) {
+    batchAppend(keys, vals);
+    sort();
+  }
+
+  template <typename K, typename V>
+  template <typename Iter>
+  void HugeMap<K, V>::batchAppend(const Iter& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+  }
+
+  template <typename K, typename V>
+  void HugeMap<K, V>::batchAppend(const std::initializer_list<std::pair<K, V>>&& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+  }
+
+  template <typename K, typename V>
+  template <typename IterK, typename IterV>
+  void HugeMap<K, V>::batchAppend(const IterK& keys, const IterV& vals) {
+    BOOST_FOREACH(const auto kv, boost::combine(keys, vals)) {
+      rawAppend(boost::get<0>(kv), boost::get<1>(kv));
+    }
+  }
+
+  template <typename K, typename V>
+  template <typename Val>
+  bool HugeMap<K, V>::replace(const K& key, Val&& val) {
+    iterator it = rawFind(key);
+    if (it == m_keys.end())
+      return false;
+    *it->second = std::forward<Val>(val);
+    return true;
+  }
+
+  template <typename K, typename V>
+  template <bool noReplace, typename Val>
+  void HugeMap<K, V>::rawAppend(const K& key, Val&& val) {
+    if (!noReplace && replace(key, std::forward<Val>(val)))
+      return;
+    if (!m_keys.empty() && !(m_keys.back().first < key))
+      m_sorted = false;
+    m_keys.push_back(KV(key, m_vals.create(std::forward<Val>(val))));
+  }
+
+  template <typename K, typename V>
+  bool HugeMap<K, V>::remove(const K& key) {
+    iterator it = rawFind(key);
+    if (it == m_keys.end())
+      return false;
+    m_vals.destroy(it->second);
+    if (m_sorted) {
+      m_keys.erase(it);
+    } else {
+      *it = m_keys.back();
+      m_keys.pop_back();
+    }
+    return true;
+  }
+
+  template <typename K, typename V>
+  size_t HugeMap<K, V>::findIndex(const K& key) const {
+    const KV* first = m_keys.data();
+    const KV* last = first + m_keys.size();
+    if (m_sorted)
+      return findSortedKey(first, last, key) - first;
+    return scanKeys(first, last, key) - first;
+  }
+
+  template <typename K, typename V>
+  void HugeMap<K, V>::sort() {
+    matan::timsort(m_keys.begin(), m_keys.end(), keyComp);
+    m_sorted = true;
+  }
+} //namespace matan
@@ -0,0 +1,233 @@
+/*
+ * Linear searches over an array of (key, something) pairs, like the m_keys
+ * vector in BigMap.
+ *
+ * For arithmetic keys we compare a whole vector register worth of pairs
+ * against the key at once, and then mask off the lanes that hold the second
+ * half of each pair (or padding), instead of walking one pair at a time.
+ * The instruction set is picked at compile time (-mavx2 / -msse4.1, or just
+ * -march=native), anything else gets the plain loop.
+ *
+ * The pair must start with the key and be a power of 2 no bigger than a
+ * register, which is the case for std::pair<u32/u64/float/double, V*>.
+ * The key searched for can be of another type than the pairs' keys (a
+ * string_view for string keys), as long as they compare, but then we
+ * always take the plain loop.
+ */
+#pragma once
+
+#include <type_traits>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <cstddef>
+#include <cstring>
+#include "general.hh"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+namespace matan {
+
+namespace keyscan {
+
+#if defined(__AVX2__)
+constexpr size_t REGISTER_BYTES = 32;
+#elif defined(__SSE4_1__)
+constexpr size_t REGISTER_BYTES = 16;
+#else
+constexpr size_t REGISTER_BYTES = 0;
+#endif
+
+template <typename KV, typename K>
+struct Traits {
+  static constexpr bool vectorized =
+    REGISTER_BYTES != 0 &&
+    std::is_arithmetic<K>::value &&
+    std::is_same<K, typename KV::first_type>::value &&
+    (sizeof(K) == 4 || sizeof(K) == 8) &&
+    sizeof(KV) % sizeof(K) == 0 &&
+    REGISTER_BYTES % sizeof(KV) == 0;
+  static constexpr size_t PER_REGISTER = vectorized ? REGISTER_BYTES / sizeof(KV) : 1;
+
+  /*
+   * One bit per byte of the register (what movemask_epi8 gives back), set
+   * for the bytes of each key. Everything else belongs to the values or
+   * padding, which we don't care about.
+   */
+  static constexpr u32 keyMask() {
+    u32 mask = 0;
+    for (size_t i = 0; i < PER_REGISTER; i++) {
+      for (size_t b = 0; b < sizeof(K); b++) {
+        mask |= u32(1) << (i * sizeof(KV) + b);
+      }
+    }
+    return mask;
+  }
+};
+
+#if defined(__AVX2__)
+template <typename K>
+inline u32 matchBytes(const void* p, const K& key) {
+  const __m256i block = _mm256_loadu_si256(static_cast<const __m256i*>(p));
+  __m256i eq;
+  if constexpr (std::is_same<K, float>::value) {
+    eq = _mm256_castps_si256(_mm256_cmp_ps(_mm256_castsi256_ps(block), _mm256_set1_ps(key), _CMP_EQ_OQ));
+  } else if constexpr (std::is_same<K, double>::value) {
+    eq = _mm256_castpd_si256(_mm256_cmp_pd(_mm256_castsi256_pd(block), _mm256_set1_pd(key), _CMP_EQ_OQ));
+  } else if constexpr (sizeof(K) == 4) {
+    s32 bits;
+    std::memcpy(&bits, &key, 4);
+    eq = _mm256_cmpeq_epi32(block, _mm256_set1_epi32(bits));
+  } else {
+    s64 bits;
+    std::memcpy(&bits, &key, 8);
+    eq = _mm256_cmpeq_epi64(block, _mm256_set1_epi64x(bits));
+  }
+  return u32(_mm256_movemask_epi8(eq));
+}
+#elif defined(__SSE4_1__)
+template <typename K>
+inline u32 matchBytes(const void* p, const K& key) {
+  const __m128i block = _mm_loadu_si128(static_cast<const __m128i*>(p));
+  __m128i eq;
+  if constexpr (std::is_same<K, float>::value) {
+    eq = _mm_castps_si128(_mm_cmpeq_ps(_mm_castsi128_ps(block), _mm_set1_ps(key)));
+  } else if constexpr (std::is_same<K, double>::value) {
+    eq = _mm_castpd_si128(_mm_cmpeq_pd(_mm_castsi128_pd(block), _mm_set1_pd(key)));
+  } else if constexpr (sizeof(K) == 4) {
+    s32 bits;
+    std::memcpy(&bits, &key, 4);
+    eq = _mm_cmpeq_epi32(block, _mm_set1_epi32(bits));
+  } else {
+    s64 bits;
+    std::memcpy(&bits, &key, 8);
+    eq = _mm_cmpeq_epi64(block, _mm_set1_epi64x(bits));
+  }
+  return u32(_mm_movemask_epi8(eq));
+}
+#else
+template <typename K>
+inline u32 matchBytes(const void*, const K&) { return 0; }
+#endif
+
+} // keyscan
+
+/*
+ * First pair in [first, last) whose key == key, or last.
+ */
+template <typename KV, typename K>
+const KV* scanKeys(const KV* first, const KV* last, const K& key) {
+  typedef keyscan::Traits<KV, K> Traits;
+  if constexpr (Traits::vectorized) {
+    constexpr u32 mask = Traits::keyMask();
+    constexpr size_t step = Traits::PER_REGISTER;
+    //2 registers per iteration, so a whole cache line of 16 byte pairs.
+    for (; last - first >= ptrdiff_t(2 * step); first += 2 * step) {
+      const u32 lo = keyscan::matchBytes(first, key) & mask;
+      const u32 hi = keyscan::matchBytes(first + step, key) & mask;
+      if (unlikely((lo | hi) != 0)) {
+        return lo != 0 ? first + __builtin_ctz(lo) / sizeof(KV)
+                       : first + step + __builtin_ctz(hi) / sizeof(KV);
+      }
+    }
+    if (last - first >= ptrdiff_t(step)) {
+      const u32 m = keyscan::matchBytes(first, key) & mask;
+      if (m != 0)
+        return first + __builtin_ctz(m) / sizeof(KV);
+      first += step;
+    }
+  }
+  for (; first != last; ++first) {
+    if (unlikely(first->first == key))
+      return first;
+  }
+  return last;
+}
+
+/*
+ * First pair in the sorted range [first, last) whose key == key, or last.
+ * less is what the range is sorted by, and has to agree with ==.
+ *
+ * Binary search (branchless) until the range is down to a couple of cache
+ * lines and then finish with scanKeys, which is cheaper than the last few
+ * dependent steps of the binary search. Types scanKeys can't vectorize just
+ * use std::lower_bound.
+ */
+template <typename KV, typename K, typename Less=std::less<>>
+const KV* findSortedKey(const KV* first, const KV* last, const K& key, const Less& less=Less()) {
+  if constexpr (keyscan::Traits<KV, K>::vectorized) {
+    constexpr size_t SCAN_WIDTH = 128 / sizeof(KV);
+    const KV* base = first;
+    size_t n = last - first;
+    while (n > SCAN_WIDTH) {
+      const size_t half = n / 2;
+      base = less(base[half].first, key) ? base + half : base;
+      n -= half;
+    }
+    /*
+     * Everything before base is < key, and everything from base+n on is
+     * >= key, so if key is here it's in [base, base+n].
+     */
+    const KV* end = std::min(base + n + 1, last);
+    const KV* it = scanKeys(base, end, key);
+    return it == end ? last : it;
+  } else {
+    const KV* it = std::lower_bound(first, last, key,
+                                    [&less](const KV& kv, const K& k) { return less(kv.first, k); });
+    return (it != last && !less(key, it->first)) ? it : last;
+  }
+}
+
+/*
+ * For integral keys sorted ascending and spread out close to evenly
+ * (timestamps, sequence numbers). Narrows [first, last) down to [lo, hi)
+ * such that every key before lo is < key and every key from hi on is > key,
+ * so key's lower bound is in [lo, hi] and key, if it's there, is in
+ * [lo, hi).
+ *
+ * Each probe guesses where key is from the keys at either end of the range,
+ * the way you'd open a phone book, which on even keys lands within a few
+ * slots of it. Uneven keys can make the guesses crawl, so we stop after
+ * MAX_PROBES (or once the range is down to a couple of cache lines) and
+ * leave the rest to a binary search.
+ */
+template <typename KV, typename K>
+std::pair<const KV*, const KV*> interpolateRange(const KV* first, const KV* last, const K& key) {
+  static_assert(std::is_integral<K>::value, "interpolation needs integral keys");
+  constexpr size_t MAX_PROBES = 4;
+  constexpr size_t MIN_RANGE = 128 / sizeof(KV) + 1;
+  const KV* lo = first;
+  const KV* hi = last;
+  for (size_t probe = 0; probe < MAX_PROBES && size_t(hi - lo) > MIN_RANGE; probe++) {
+    const K loKey = lo->first;
+    const K hiKey = (hi-1)->first;
+    if (key <= loKey)
+      return key == loKey ? std::make_pair(lo, lo + 1) : std::make_pair(lo, lo);
+    if (key > hiKey)
+      return std::make_pair(hi, hi);
+    //Differences as u64 so signed keys can't overflow, key > loKey so they're exact.
+    const double fraction = double(u64(key) - u64(loKey)) / double(u64(hiKey) - u64(loKey));
+    const KV* guess = lo + std::min(size_t(fraction * (hi - lo - 1)), size_t(hi - lo - 1));
+    if (guess->first < key)
+      lo = guess + 1;
+    else if (key < guess->first)
+      hi = guess;
+    else
+      return std::make_pair(guess, guess + 1);
+  }
+  return std::make_pair(lo, hi);
+}
+
+/*
+ * findSortedKey, but narrowed down first with interpolateRange.
+ */
+template <typename KV, typename K>
+const KV* interpolateSortedKey(const KV* first, const KV* last, const K& key) {
+  const auto range = interpolateRange(first, last, key);
+  const KV* it = findSortedKey(range.first, range.second, key);
+  return it == range.second ? last : it;
+}
+
+} // matan
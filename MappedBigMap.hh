@@ -0,0 +1,257 @@
+/*
+ * Read only view of a BigMap snapshot (see BigMap::saveSnapshot) that is
+ * mmapped straight from the file. Nothing gets deserialized, find and
+ * iteration run right on the mapped pages, so opening a map of any size is
+ * just an mmap, and every process that opens the same snapshot shares the
+ * same page cache.
+ *
+ * Only for trivially copyable K and V, since they're written out as raw
+ * bytes, and a snapshot is only good on a machine with the same layout for
+ * them (which open checks as best it can, by size).
+ *
+ * Compare has to be what the BigMap that saved the snapshot sorted by.
+ *
+ * File layout, all in native byte order:
+ *   Header
+ *   K keys[size]    sorted, at keysOffset
+ *   V vals[size]    vals[i] belongs to keys[i], at valsOffset
+ */
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <cstdio>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "general.hh"
+
+namespace matan {
+
+  namespace snapshot {
+    constexpr u64 MAGIC = 0x50414d4749424d53ull; //"SMBIGMAP" read as little endian
+    constexpr u32 VERSION = 1;
+    constexpr size_t ALIGN = 64; //so both arrays start on a cache line
+
+    struct Header {
+      u64 magic;
+      u32 version;
+      u32 keySize;
+      u32 valSize;
+      u32 unused;
+      u64 size;
+      u64 keysOffset;
+      u64 valsOffset;
+    };
+
+    inline u64 alignUp(u64 n) { return (n + ALIGN - 1) / ALIGN * ALIGN; }
+
+    template <typename K, typename V>
+    Header makeHeader(size_t n) {
+      Header header = {MAGIC, VERSION, sizeof(K), sizeof(V), 0, n, 0, 0};
+      header.keysOffset = alignUp(sizeof(Header));
+      header.valsOffset = alignUp(header.keysOffset + n * sizeof(K));
+      return header;
+    }
+
+    /*
+     * keyAt(i) gives the i'th key, in sorted order, and vals is the values
+     * in the same order. Written to path.tmp and renamed over path, so
+     * anyone opening path sees either the old snapshot or the whole new one.
+     */
+    template <typename K, typename V, typename KeyAt>
+    bool write(const std::string& path, size_t n, const KeyAt& keyAt, const V* vals) {
+      static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                    "snapshots are raw bytes, K and V must be trivially copyable");
+      const Header header = makeHeader<K, V>(n);
+      const std::string tmpPath = path + ".tmp";
+      std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+      const char zeros[ALIGN] = {0};
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(zeros, header.keysOffset - sizeof(header));
+
+      //Keys are pulled out of their (K, handle) pairs a block at a time.
+      K block[4096 / sizeof(K) + 1];
+      const size_t perBlock = sizeof(block) / sizeof(K);
+      for (size_t i = 0; i < n; i += perBlock) {
+        const size_t count = std::min(perBlock, n - i);
+        for (size_t j = 0; j < count; j++) {
+          block[j] = keyAt(i + j);
+        }
+        out.write(reinterpret_cast<const char*>(block), count * sizeof(K));
+      }
+      out.write(zeros, header.valsOffset - header.keysOffset - n * sizeof(K));
+      out.write(reinterpret_cast<const char*>(vals), n * sizeof(V));
+      out.close();
+      if (out.fail()) {
+        std::remove(tmpPath.c_str());
+        return false;
+      }
+      return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+  } // snapshot
+
+  template <typename K, typename V, typename Compare=std::less<K>>
+  class MappedBigMap {
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                  "snapshots are raw bytes, K and V must be trivially copyable");
+  public:
+    /*
+     * Snapshots are deep sorted, so the keys and values are parallel arrays
+     * and there's no handle to follow, the values are walked in step with
+     * the keys.
+     */
+    class const_iterator {
+    public:
+      typedef std::random_access_iterator_tag iterator_category;
+      typedef std::pair<const K&, const V&> value_type;
+      typedef value_type reference;
+      typedef void pointer;
+      typedef std::ptrdiff_t difference_type;
+
+      const_iterator(const K* key, const V* val) : m_key(key), m_val(val) {}
+
+      reference operator*() const { return reference(*m_key, *m_val); }
+      const K& key() const { return *m_key; }
+      const V& value() const { return *m_val; }
+
+      const_iterator& operator++() { ++m_key; ++m_val; return *this; }
+      const_iterator operator++(int) { const_iterator temp = *this; ++(*this); return temp; }
+      const_iterator& operator--() { --m_key; --m_val; return *this; }
+      const_iterator operator--(int) { const_iterator temp = *this; --(*this); return temp; }
+      const_iterator& operator+=(difference_type n) { m_key += n; m_val += n; return *this; }
+      const_iterator operator+(difference_type n) const { return const_iterator(m_key + n, m_val + n); }
+      difference_type operator-(const const_iterator& other) const { return m_key - other.m_key; }
+
+      bool operator==(const const_iterator& other) const { return m_key == other.m_key; };
+      bool operator!=(const const_iterator& other) const { return m_key != other.m_key; };
+      bool operator<(const const_iterator& other) const { return m_key < other.m_key; };
+
+    private:
+      const K* m_key;
+      const V* m_val;
+    };
+
+    MappedBigMap() = default;
+    explicit MappedBigMap(const std::string& path) { open(path); }
+    MappedBigMap(const MappedBigMap&) = delete;
+    MappedBigMap& operator=(const MappedBigMap&) = delete;
+    MappedBigMap(MappedBigMap&& other) noexcept { *this = std::move(other); }
+    MappedBigMap& operator=(MappedBigMap&& other) noexcept;
+    ~MappedBigMap() { close(); }
+
+    /*
+     * False if the file can't be mapped or doesn't look like a snapshot of
+     * this K and V, in which case the map is left empty.
+     */
+    bool open(const std::string& path);
+    void close();
+    bool isOpen() const { return m_base != nullptr; }
+
+    const_iterator begin() const { return const_iterator(m_keys, m_vals); }
+    const_iterator end() const { return const_iterator(m_keys + m_size, m_vals + m_size); }
+    size_t size() const { return m_size; }
+
+    const_iterator find(const K& key) const;
+    const_iterator lower_bound(const K& key) const;
+
+  private:
+    Compare m_comp;
+    void* m_base = nullptr;
+    size_t m_length = 0;
+    const K* m_keys = nullptr;
+    const V* m_vals = nullptr;
+    size_t m_size = 0;
+  };
+
+  template <typename K, typename V, typename Compare>
+  MappedBigMap<K, V, Compare>& MappedBigMap<K, V, Compare>::operator=(MappedBigMap&& other) noexcept {
+    if (this != &other) {
+      close();
+      std::swap(m_base, other.m_base);
+      std::swap(m_length, other.m_length);
+      std::swap(m_keys, other.m_keys);
+      std::swap(m_vals, other.m_vals);
+      std::swap(m_size, other.m_size);
+    }
+    return *this;
+  }
+
+  template <typename K, typename V, typename Compare>
+  bool MappedBigMap<K, V, Compare>::open(const std::string& path) {
+    close();
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(snapshot::Header)) {
+      ::close(fd);
+      return false;
+    }
+    const size_t length = st.st_size;
+    void* base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); //The mapping keeps the file alive.
+    if (base == MAP_FAILED)
+      return false;
+
+    const snapshot::Header& header = *static_cast<const snapshot::Header*>(base);
+    const snapshot::Header expected = snapshot::makeHeader<K, V>(header.size);
+    if (header.magic != snapshot::MAGIC || header.version != snapshot::VERSION ||
+        header.size > length || //before it can overflow the offsets below
+        header.keySize != sizeof(K) || header.valSize != sizeof(V) ||
+        header.keysOffset != expected.keysOffset || header.valsOffset != expected.valsOffset ||
+        length < header.valsOffset + header.size * sizeof(V)) {
+      munmap(base, length);
+      return false;
+    }
+
+    m_base = base;
+    m_length = length;
+    m_size = header.size;
+    m_keys = reinterpret_cast<const K*>(static_cast<const char*>(base) + header.keysOffset);
+    m_vals = reinterpret_cast<const V*>(static_cast<const char*>(base) + header.valsOffset);
+    return true;
+  }
+
+  template <typename K, typename V, typename Compare>
+  void MappedBigMap<K, V, Compare>::close() {
+    if (m_base != nullptr)
+      munmap(m_base, m_length);
+    m_base = nullptr;
+    m_length = 0;
+    m_keys = nullptr;
+    m_vals = nullptr;
+    m_size = 0;
+  }
+
+  template <typename K, typename V, typename Compare>
+  typename MappedBigMap<K, V, Compare>::const_iterator
+  MappedBigMap<K, V, Compare>::lower_bound(const K& key) const {
+    //Same branchless search as findSortedKey, but over bare keys.
+    const K* base = m_keys;
+    size_t n = m_size;
+    while (n > 1) {
+      const size_t half = n / 2;
+      base = m_comp(base[half], key) ? base + half : base;
+      n -= half;
+    }
+    if (m_size != 0 && m_comp(*base, key))
+      ++base;
+    return begin() + (base - m_keys);
+  }
+
+  template <typename K, typename V, typename Compare>
+  typename MappedBigMap<K, V, Compare>::const_iterator
+  MappedBigMap<K, V, Compare>::find(const K& key) const {
+    const const_iterator it = lower_bound(key);
+    return (it != end() && !m_comp(key, it.key())) ? it : end();
+  }
+} //namespace matan
@@ -0,0 +1,503 @@
+/*
+ * BigMap for string keys, where the keys themselves are the problem. A
+ * BigMap<std::string, V> is a vector of std::strings, so each key longer
+ * than the small string buffer is its own heap allocation, and every step
+ * of a binary search is a pointer chase to wherever that string ended up.
+ * Keys like paths or symbols also spend most of their bytes repeating the
+ * key before them.
+ *
+ * Here the sorted keys are front coded into 1 contiguous byte array, BLOCK
+ * keys to a block. A block starts with its first key in full, and every
+ * key after that only stores how many leading bytes it shares with the key
+ * before it, and the rest. On top of that is a small sparse index of each
+ * block's offset and the 8 bytes of its first key right after the prefix
+ * every key shares, so a search is a binary search over a packed array of
+ * u64s, then a scan of 1 block, and never has to piece a key back
+ * together to compare against it.
+ *
+ * The price is that the blocks can only be rebuilt as a whole. insert
+ * writes over a key that's already there in place, and otherwise goes into
+ * a small sorted pending run that is folded into the blocks by sort() (or
+ * once it hits PENDING_MAX keys). So this is for maps that are loaded in
+ * bulk, with batchInsert, and then mostly read. Values are kept in key
+ * order, like a deep sorted BigMap.
+ *
+ *   PrefixMap<long> sizes;
+ *   sizes.batchInsert(pathsAndSizes);
+ *   const long* size = sizes.find(std::string_view(buf, len));
+ */
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <initializer_list>
+
+#include "timsort.hh"
+#include "general.hh"
+
+namespace matan {
+  template <typename V, size_t BLOCK=16>
+  class PrefixMap {
+    static_assert(BLOCK > 0, "blocks need at least 1 key");
+  public:
+    static constexpr size_t PENDING_MAX = 1024;
+
+  private:
+    //Decodes the keys 1 at a time, starting anywhere.
+    class Cursor {
+    public:
+      Cursor(const PrefixMap* map, size_t pos);
+      void next();
+      size_t pos() const { return m_pos; }
+      const std::string& key() const { return m_key; }
+
+    private:
+      void read(); //the key at m_pos, m_next points at it
+      const PrefixMap* m_map;
+      size_t m_pos;
+      const char* m_next;
+      std::string m_key;
+    };
+
+    //Writes sorted keys out into a fresh set of blocks.
+    class Builder {
+    public:
+      explicit Builder(size_t n);
+      void add(std::string_view key, V&& val);
+      void finish(PrefixMap& map);
+
+    private:
+      std::vector<char> m_bytes;
+      std::vector<size_t> m_blocks;
+      std::vector<V> m_vals;
+      std::string m_prev;
+    };
+
+  public:
+    //Hands out (key, value) pairs. The key is only good until the iterator moves.
+    class iterator {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef std::pair<std::string_view, V&> value_type;
+      typedef value_type reference;
+      typedef void pointer;
+      typedef std::ptrdiff_t difference_type;
+
+      iterator(PrefixMap* map, size_t pos) : m_map(map), m_cursor(map, pos) {}
+      reference operator*() const { return reference(key(), value()); }
+      std::string_view key() const { return m_cursor.key(); }
+      V& value() const { return m_map->m_vals[m_cursor.pos()]; }
+      iterator& operator++() { m_cursor.next(); return *this; }
+      iterator operator++(int) { iterator temp = *this; ++(*this); return temp; }
+      bool operator==(const iterator& other) const { return m_cursor.pos() == other.m_cursor.pos(); };
+      bool operator!=(const iterator& other) const { return m_cursor.pos() != other.m_cursor.pos(); };
+
+    private:
+      PrefixMap* m_map;
+      Cursor m_cursor;
+    };
+
+    struct Range {
+      iterator first;
+      iterator last;
+      iterator begin() const { return first; }
+      iterator end() const { return last; }
+      bool empty() const { return first == last; }
+    };
+
+    PrefixMap() = default;
+
+    template <typename Iter>
+    PrefixMap(const Iter& pairs) { batchInsert(pairs); }
+
+    size_t size() const { return m_vals.size() - m_numDead + m_pending.size(); }
+    bool isSorted() const { return m_pending.empty() && m_numDead == 0; }
+    //What the keys take up, sparse index included.
+    size_t keyBytes() const;
+
+    //nullptr if key isn't there.
+    V* find(std::string_view key);
+    const V* find(std::string_view key) const;
+
+    void insert(std::string_view key, const V& val) { rawInsert(key, val); }
+    void insert(std::string_view key, V&& val) { rawInsert(key, std::move(val)); }
+
+    /*
+     * Pairs of something a std::string can be made from, and a V. The
+     * values are moved in if iterating pairs gives rvalues.
+     */
+    template <typename Iter>
+    void batchInsert(const Iter& pairs);
+    void batchInsert(const std::initializer_list<std::pair<std::string, V>>&& pairs);
+
+    bool remove(std::string_view key);
+
+    //Fold the pending keys into the blocks and drop removed keys.
+    void sort();
+
+    /*
+     * Iteration and ordered queries work on the blocks, so they sort()
+     * first if need be, which is why there are no const versions. range(lo,
+     * hi) covers the keys in [lo, hi).
+     */
+    iterator begin() { sort(); return iterator(this, 0); }
+    iterator end() { sort(); return iterator(this, m_vals.size()); }
+    iterator lower_bound(std::string_view key);
+    Range range(std::string_view lo, std::string_view hi);
+
+  private:
+    /*
+     * Block layout, for the key at index i:
+     *   i % BLOCK == 0: varint length, the key
+     *   otherwise:      varint shared, varint length - shared, the key past shared
+     * where shared is how many leading bytes it has in common with key i-1.
+     */
+    std::vector<char> m_bytes;
+    std::vector<size_t> m_blocks; //where each block starts in m_bytes
+    /*
+     * The 8 bytes of each block's first key starting at m_skip, big endian
+     * and 0 padded, so comparing heads compares the keys (unless they tie).
+     */
+    std::vector<u64> m_heads;
+    size_t m_skip = 0; //every key starts with the same m_skip bytes
+    std::vector<V> m_vals; //m_vals[i] belongs to key i
+    std::vector<bool> m_dead;
+    size_t m_numDead = 0;
+    std::vector<std::pair<std::string, V>> m_pending; //sorted, none of them are in the blocks
+
+    struct Hit {
+      size_t pos; //first key in the blocks that is not less than the one searched for
+      bool found;
+    };
+    Hit search(std::string_view key) const;
+    size_t findPending(std::string_view key) const; //m_pending.size() if not there
+    template <typename Arg>
+    void rawInsert(std::string_view key, Arg&& val);
+    std::string_view firstKey(size_t block) const;
+
+    static void putVarint(std::vector<char>& out, size_t n);
+    static size_t getVarint(const char*& p);
+    static u64 headOf(std::string_view key, size_t skip);
+    static size_t commonPrefix(std::string_view a, std::string_view b);
+  };
+
+  template <typename V, size_t BLOCK>
+  PrefixMap<V, BLOCK>::Cursor::Cursor(const PrefixMap* map, size_t pos) :
+      m_map(map), m_pos(pos - pos % BLOCK), m_next(nullptr) {
+    //Keys are only ever decoded from the start of their block.
+    if (pos >= m_map->m_vals.size()) {
+      m_pos = m_map->m_vals.size();
+      return;
+    }
+    m_next = m_map->m_bytes.data() + m_map->m_blocks[m_pos / BLOCK];
+    read();
+    while (m_pos < pos)
+      next();
+  }
+
+  template <typename V, size_t BLOCK>
+  void PrefixMap<V, BLOCK>::Cursor::next() {
+    if (++m_pos < m_map->m_vals.size())
+      read();
+  }
+
+  template <typename V, size_t BLOCK>
+  void PrefixMap<V, BLOCK>::Cursor::read() {
+    const size_t shared = (m_pos % BLOCK == 0) ? 0 : getVarint(m_next);
+    const size_t length = getVarint(m_next);
+    m_key.resize(shared);
+    m_key.append(m_next, length);
+    m_next += length;
+  }
+
+  template <typename V, size_t BLOCK>
+  PrefixMap<V, BLOCK>::Builder::Builder(size_t n) {
+    m_blocks.reserve(n / BLOCK + 1);
+    m_vals.reserve(n);
+  }
+
+  template <typename V, size_t BLOCK>
+  void PrefixMap<V, BLOCK>::Builder::add(std::string_view key, V&& val) {
+    if (m_vals.size() % BLOCK == 0) {
+      m_blocks.push_back(m_bytes.size());
+      putVarint(m_bytes, key.size());
+      m_bytes.insert(m_bytes.end(), key.begin(), key.end());
+    } else {
+      const size_t shared = commonPrefix(m_prev, key);
+      putVarint(m_bytes, shared);
+      putVarint(m_bytes, key.size() - shared);
+      m_bytes.insert(m_bytes.end(), key.begin() + shared, key.end());
+    }
+    m_prev.assign(key.data(), key.size());
+    m_vals.push_back(std::move(val));
+  }
+
+  template <typename V, size_t BLOCK>
+  void PrefixMap<V, BLOCK>::Builder::finish(PrefixMap& map) {
+    m_bytes.shrink_to_fit();
+    map.m_bytes.swap(m_bytes);
+    map.m_blocks.swap(m_blocks);
+    map.m_vals.swap(m_vals);
+    map.m_dead.assign(map.m_vals.size(), false);
+    map.m_numDead = 0;
+    //The first and last keys share the prefix that every key in between does.
+    map.m_skip = map.m_vals.empty() ? 0 : commonPrefix(map.firstKey(0), m_prev);
+    map.m_heads.resize(map.m_blocks.size());
+    for (size_t b = 0; b < map.m_blocks.size(); b++) {
+      map.m_heads[b] = headOf(map.firstKey(b), map.m_skip);
+    }
+  }
+
+  template <typename V, size_t BLOCK>
+  size_t PrefixMap<V, BLOCK>::keyBytes() const {
+    size_t pending = 0;
+    for (const auto& kv : m_pending) {
+      pending += sizeof(kv.first) + (kv.first.capacity() > 15 ? kv.first.capacity() : 0);
+    }
+    return m_bytes.capacity() + m_blocks.capacity() * sizeof(size_t) +
+           m_heads.capacity() * sizeof(u64) + m_dead.capacity() / 8 + pending;
+  }
+
+  template <typename V, size_t BLOCK>
+  V* PrefixMap<V, BLOCK>::find(std::string_view key) {
+    return const_cast<V*>(static_cast<const PrefixMap*>(this)->find(key));
+  }
+
+  template <typename V, size_t BLOCK>
+  const V* PrefixMap<V, BLOCK>::find(std::string_view key) const {
+    const Hit hit = search(key);
+    if (hit.found)
+      return m_dead[hit.pos] ? nullptr : &m_vals[hit.pos];
+    const size_t i = findPending(key);
+    return i == m_pending.size() ? nullptr : &m_pending[i].second;
+  }
+
+  template <typename V, size_t BLOCK>
+  template <typename Arg>
+  void PrefixMap<V, BLOCK>::rawInsert(std::string_view key, Arg&& val) {
+    const Hit hit = search(key);
+    if (hit.found) {
+      //Even a removed key still has its place in the blocks.
+      m_vals[hit.pos] = std::forward<Arg>(val);
+      if (m_dead[hit.pos]) {
+        m_dead[hit.pos] = false;
+        --m_numDead;
+      }
+      return;
+    }
+    const auto it = std::lower_bound(m_pending.begin(), m_pending.end(), key,
+                                     [](const auto& kv, std::string_view k) { return kv.first < k; });
+    if (it != m_pending.end() && it->first == key) {
+      it->second = std::forward<Arg>(val);
+      return;
+    }
+    m_pending.emplace(it, std::string(key), std::forward<Arg>(val));
+    if (m_pending.size() >= PENDING_MAX)
+      sort();
+  }
+
+  template <typename V, size_t BLOCK>
+  template <typename Iter>
+  void PrefixMap<V, BLOCK>::batchInsert(const Iter& pairs) {
+    //Straight onto the end of pending, sort() puts them in order and drops repeats.
+    for (auto&& kv : pairs) {
+      m_pending.emplace_back(std::string(kv.first), std::forward<decltype(kv)>(kv).second);
+    }
+    sort();
+  }
+
+  template <typename V, size_t BLOCK>
+  void PrefixMap<V, BLOCK>::batchInsert(const std::initializer_list<std::pair<std::string, V>>&& pairs) {
+    for (const auto& kv : pairs) {
+      m_pending.push_back(kv);
+    }
+    sort();
+  }
+
+  template <typename V, size_t BLOCK>
+  bool PrefixMap<V, BLOCK>::remove(std::string_view key) {
+    const Hit hit = search(key);
+    if (hit.found) {
+      if (m_dead[hit.pos])
+        return false;
+      m_dead[hit.pos] = true;
+      ++m_numDead;
+      return true;
+    }
+    const size_t i = findPending(key);
+    if (i == m_pending.size())
+      return false;
+    m_pending.erase(m_pending.begin() + i);
+    return true;
+  }
+
+  template <typename V, size_t BLOCK>
+  void PrefixMap<V, BLOCK>::sort() {
+    if (isSorted())
+      return;
+    /*
+     * timsort is stable, so of the pairs with the same key, the last one
+     * is the last one inserted, and that's the one we keep.
+     */
+    matan::timsort(m_pending.begin(), m_pending.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+    auto keep = m_pending.begin();
+    for (auto it = m_pending.begin(); it != m_pending.end(); ++it) {
+      if (std::next(it) != m_pending.end() && std::next(it)->first == it->first)
+        continue;
+      if (keep != it)
+        *keep = std::move(*it);
+      ++keep;
+    }
+    m_pending.erase(keep, m_pending.end());
+
+    //Merge the live keys with pending, pending wins a tie.
+    Builder builder(m_vals.size() - m_numDead + m_pending.size());
+    Cursor old(this, 0);
+    auto pending = m_pending.begin();
+    while (old.pos() < m_vals.size() || pending != m_pending.end()) {
+      if (old.pos() < m_vals.size() && m_dead[old.pos()]) {
+        old.next();
+      } else if (pending == m_pending.end() ||
+                 (old.pos() < m_vals.size() && old.key() < pending->first)) {
+        builder.add(old.key(), std::move(m_vals[old.pos()]));
+        old.next();
+      } else {
+        if (old.pos() < m_vals.size() && old.key() == pending->first)
+          old.next();
+        builder.add(pending->first, std::move(pending->second));
+        ++pending;
+      }
+    }
+    builder.finish(*this);
+    m_pending.clear();
+  }
+
+  template <typename V, size_t BLOCK>
+  typename PrefixMap<V, BLOCK>::iterator PrefixMap<V, BLOCK>::lower_bound(std::string_view key) {
+    sort();
+    return iterator(this, search(key).pos);
+  }
+
+  template <typename V, size_t BLOCK>
+  typename PrefixMap<V, BLOCK>::Range PrefixMap<V, BLOCK>::range(std::string_view lo, std::string_view hi) {
+    sort();
+    return Range{iterator(this, search(lo).pos), iterator(this, search(hi).pos)};
+  }
+
+  template <typename V, size_t BLOCK>
+  typename PrefixMap<V, BLOCK>::Hit PrefixMap<V, BLOCK>::search(std::string_view key) const {
+    const size_t n = m_vals.size();
+    if (n == 0)
+      return Hit{0, false};
+
+    //Keys that don't start like every key does are before or after all of them.
+    const int prefix = key.compare(0, m_skip, firstKey(0).substr(0, m_skip));
+    if (prefix != 0)
+      return Hit{prefix < 0 ? 0 : n, false};
+
+    /*
+     * The last block whose first key is <= key. Branchless on the heads,
+     * only ties need a look at the key itself.
+     */
+    const u64 head = headOf(key, m_skip);
+    const auto after = [this, head, &key](size_t b) {
+      return head < m_heads[b] || (head == m_heads[b] && key < firstKey(b));
+    };
+    size_t base = 0;
+    size_t count = m_heads.size();
+    while (count > 1) {
+      const size_t half = count / 2;
+      base = after(base + half) ? base : base + half;
+      count -= half;
+    }
+    if (after(base))
+      return Hit{0, false};
+
+    /*
+     * Scan the block. matched is how much of key the previous key matches,
+     * and the previous key is always < key. So a key sharing more than
+     * matched with the previous one is also < key, and one sharing less is
+     * > key. Only when it shares exactly matched do we look at its bytes.
+     */
+    const char* p = m_bytes.data() + m_blocks[base];
+    size_t length = getVarint(p);
+    size_t matched = commonPrefix(std::string_view(p, length), key);
+    if (matched == length && matched == key.size())
+      return Hit{base * BLOCK, true};
+    p += length;
+    const size_t last = std::min(n, (base + 1) * BLOCK);
+    for (size_t i = base * BLOCK + 1; i < last; i++) {
+      const size_t shared = getVarint(p);
+      length = getVarint(p);
+      const std::string_view rest(p, length);
+      p += length;
+      if (shared > matched)
+        continue;
+      if (shared < matched)
+        return Hit{i, false};
+      const size_t more = commonPrefix(rest, key.substr(matched));
+      if (matched + more == key.size())
+        return Hit{i, more == length};
+      if (more < length && u8(rest[more]) > u8(key[matched + more]))
+        return Hit{i, false};
+      matched += more;
+    }
+    return Hit{last, false};
+  }
+
+  template <typename V, size_t BLOCK>
+  size_t PrefixMap<V, BLOCK>::findPending(std::string_view key) const {
+    const auto it = std::lower_bound(m_pending.begin(), m_pending.end(), key,
+                                     [](const auto& kv, std::string_view k) { return kv.first < k; });
+    return (it != m_pending.end() && it->first == key) ? it - m_pending.begin() : m_pending.size();
+  }
+
+  template <typename V, size_t BLOCK>
+  std::string_view PrefixMap<V, BLOCK>::firstKey(size_t block) const {
+    const char* p = m_bytes.data() + m_blocks[block];
+    const size_t length = getVarint(p);
+    return std::string_view(p, length);
+  }
+
+  template <typename V, size_t BLOCK>
+  void PrefixMap<V, BLOCK>::putVarint(std::vector<char>& out, size_t n) {
+    //7 bits a byte, high bit set on all but the last.
+    while (n >= 0x80) {
+      out.push_back(char(n | 0x80));
+      n >>= 7;
+    }
+    out.push_back(char(n));
+  }
+
+  template <typename V, size_t BLOCK>
+  size_t PrefixMap<V, BLOCK>::getVarint(const char*& p) {
+    size_t n = u8(*p) & 0x7f;
+    for (size_t shift = 7; u8(*p++) & 0x80; shift += 7) {
+      n |= size_t(u8(*p) & 0x7f) << shift;
+    }
+    return n;
+  }
+
+  template <typename V, size_t BLOCK>
+  u64 PrefixMap<V, BLOCK>::headOf(std::string_view key, size_t skip) {
+    u64 head = 0;
+    for (size_t i = 0; i < 8; i++) {
+      head = (head << 8) | (skip + i < key.size() ? u8(key[skip + i]) : 0);
+    }
+    return head;
+  }
+
+  template <typename V, size_t BLOCK>
+  size_t PrefixMap<V, BLOCK>::commonPrefix(std::string_view a, std::string_view b) {
+    const size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i])
+      ++i;
+    return i;
+  }
+} //namespace matan
@@ -0,0 +1,259 @@
+/*
+ * Shards BigMaps by key hash, each behind its own lock, so that threads
+ * writing different keys mostly don't contend. Each shard is padded out to
+ * its own cache lines, so taking one shard's lock doesn't bounce the line
+ * holding its neighbour's.
+ *
+ * Since a BigMap can reallocate or shift on any write, nothing handed out
+ * points into a shard once its lock is let go. So lookups copy the value
+ * out, or run a function on it under the lock (visit). The one exception
+ * is ordered(), which holds every lock for as long as the range lives.
+ */
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "BigMap.hh"
+#include "ThreadPool.hh"
+#include "general.hh"
+
+namespace matan {
+  template <typename K, typename V, size_t Shards=16, typename Hash=std::hash<K>>
+  class ShardedBigMap {
+  public:
+    typedef BigMap<K, V> Map;
+
+  private:
+    struct alignas(64) Shard {
+      mutable std::mutex lock;
+      Map map;
+    };
+
+    size_t shardOf(const K& key) const {
+      return (scrambleHash(m_hash(key)) >> 32) % Shards;
+    }
+
+    Shard m_shards[Shards];
+    Hash m_hash;
+
+  public:
+    /*
+     * All the keys in order, by a k-way merge of the shards. Holds every
+     * shard's lock (and so blocks all writers) for as long as it lives,
+     * and sorts any shard that isn't sorted when made. Single pass.
+     */
+    class OrderedRange {
+    public:
+      class iterator {
+      public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef std::pair<const K&, V&> value_type;
+        typedef value_type reference;
+        typedef void pointer;
+        typedef std::ptrdiff_t difference_type;
+
+        explicit iterator(OrderedRange* range) : m_range(range) {}
+        reference operator*() const { return m_range->current(); }
+        iterator& operator++() { m_range->advance(); return *this; }
+        //Only ever compared to end(), which is done when the heap runs dry.
+        bool operator==(const iterator& other) const { return done() == other.done(); }
+        bool operator!=(const iterator& other) const { return done() != other.done(); }
+
+      private:
+        bool done() const { return m_range == nullptr || m_range->m_heap.empty(); }
+        OrderedRange* m_range;
+      };
+
+      explicit OrderedRange(ShardedBigMap& map);
+      OrderedRange(const OrderedRange&) = delete;
+      OrderedRange& operator=(const OrderedRange&) = delete;
+
+      iterator begin() { return iterator(this); }
+      iterator end() { return iterator(nullptr); }
+
+    private:
+      typedef typename Map::iterator MapIterator;
+      typedef typename iterator::value_type value_type;
+
+      value_type current() {
+        const size_t shard = m_heap.front();
+        return value_type(m_cursors[shard].first->first,
+                          m_map.m_shards[shard].map.value(*m_cursors[shard].first));
+      }
+      void advance();
+      //Min heap of shard numbers by their cursor's key.
+      bool later(size_t a, size_t b) const {
+        return m_cursors[b].first->first < m_cursors[a].first->first;
+      }
+
+      ShardedBigMap& m_map;
+      std::vector<std::unique_lock<std::mutex>> m_locks;
+      std::vector<std::pair<MapIterator, MapIterator>> m_cursors;
+      std::vector<size_t> m_heap;
+    };
+
+    ShardedBigMap();
+    ShardedBigMap(const ShardedBigMap&) = delete;
+    ShardedBigMap& operator=(const ShardedBigMap&) = delete;
+
+    //Everything below is safe to call from any number of threads at once.
+    void insert(const K& key, const V& val);
+    void append(const K& key, const V& val);
+    bool remove(const K& key);
+    bool find(const K& key, V& val) const; //copies the value into val
+    //Calls f(V&) under the shard's lock. False (and f isn't called) if key isn't there.
+    template <typename F>
+    bool visit(const K& key, const F& f);
+    size_t size() const;
+
+    /*
+     * Split pairs up by shard on pool's threads, then load each shard on
+     * its own thread. Ends with pool.waitFinished(), so don't share the
+     * pool with anything that might still be running. pairs has to be
+     * random access.
+     */
+    template <typename Iter>
+    void batchInsert(const Iter& pairs, ThreadPool& pool);
+
+    OrderedRange ordered() { return OrderedRange(*this); }
+  };
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  ShardedBigMap<K, V, Shards, Hash>::ShardedBigMap() {
+    //Shards are mostly appended to, which without the hash index scans the whole shard per key.
+    if constexpr (IsHashable<K>::value) {
+      for (Shard& shard : m_shards) {
+        shard.map.useHashIndex();
+      }
+    }
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  void ShardedBigMap<K, V, Shards, Hash>::insert(const K& key, const V& val) {
+    Shard& shard = m_shards[shardOf(key)];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    shard.map.insert(key, val);
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  void ShardedBigMap<K, V, Shards, Hash>::append(const K& key, const V& val) {
+    Shard& shard = m_shards[shardOf(key)];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    shard.map.append(key, val);
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  bool ShardedBigMap<K, V, Shards, Hash>::remove(const K& key) {
+    Shard& shard = m_shards[shardOf(key)];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    return shard.map.remove(key);
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  bool ShardedBigMap<K, V, Shards, Hash>::find(const K& key, V& val) const {
+    const Shard& shard = m_shards[shardOf(key)];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    const auto it = shard.map.find(key);
+    if (it == shard.map.end())
+      return false;
+    val = shard.map.value(*it);
+    return true;
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  template <typename F>
+  bool ShardedBigMap<K, V, Shards, Hash>::visit(const K& key, const F& f) {
+    Shard& shard = m_shards[shardOf(key)];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    const auto it = shard.map.find(key);
+    if (it == shard.map.end())
+      return false;
+    f(shard.map.value(*it));
+    return true;
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  size_t ShardedBigMap<K, V, Shards, Hash>::size() const {
+    size_t total = 0;
+    for (const Shard& shard : m_shards) {
+      std::lock_guard<std::mutex> lock(shard.lock);
+      total += shard.map.size();
+    }
+    return total;
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  template <typename Iter>
+  void ShardedBigMap<K, V, Shards, Hash>::batchInsert(const Iter& pairs, ThreadPool& pool) {
+    typedef std::pair<K, V> Pair;
+    const auto first = std::begin(pairs);
+    const size_t n = std::distance(first, std::end(pairs));
+    const size_t chunks = std::max(1, pool.numThreads());
+
+    //buckets[chunk * Shards + shard] is that chunk of the input's pairs for shard.
+    std::vector<std::vector<Pair>> buckets(chunks * Shards);
+    const auto partition = [this, first, n, chunks, &buckets](size_t c) {
+      for (size_t i = n * c / chunks; i < n * (c+1) / chunks; i++) {
+        const Pair& kv = *std::next(first, i);
+        buckets[c * Shards + shardOf(kv.first)].push_back(kv);
+      }
+    };
+    for (size_t c = 0; c < chunks; c++) {
+      pool.push_back(partition, c);
+    }
+    pool.waitFinished();
+
+    //Append everything then sort once per shard.
+    const auto load = [this, chunks, &buckets](size_t s) {
+      Shard& shard = m_shards[s];
+      std::lock_guard<std::mutex> lock(shard.lock);
+      size_t total = shard.map.size();
+      for (size_t c = 0; c < chunks; c++) {
+        total += buckets[c * Shards + s].size();
+      }
+      shard.map.reserve(total);
+      for (size_t c = 0; c < chunks; c++) {
+        shard.map.batchAppend(buckets[c * Shards + s]);
+      }
+      shard.map.sort();
+    };
+    for (size_t s = 0; s < Shards; s++) {
+      pool.push_back(load, s);
+    }
+    pool.waitFinished();
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  ShardedBigMap<K, V, Shards, Hash>::OrderedRange::OrderedRange(ShardedBigMap& map) : m_map(map) {
+    //Always locked in shard order, so 2 of these can't deadlock.
+    m_locks.reserve(Shards);
+    m_cursors.reserve(Shards);
+    for (Shard& shard : m_map.m_shards) {
+      m_locks.emplace_back(shard.lock);
+      if (!shard.map.isSorted())
+        shard.map.sort();
+      const MapIterator first = shard.map.begin();
+      m_cursors.emplace_back(first, shard.map.end());
+      if (first != shard.map.end())
+        m_heap.push_back(m_cursors.size() - 1);
+    }
+    const auto later = [this](size_t a, size_t b) { return this->later(a, b); };
+    std::make_heap(m_heap.begin(), m_heap.end(), later);
+  }
+
+  template <typename K, typename V, size_t Shards, typename Hash>
+  void ShardedBigMap<K, V, Shards, Hash>::OrderedRange::advance() {
+    const auto later = [this](size_t a, size_t b) { return this->later(a, b); };
+    std::pop_heap(m_heap.begin(), m_heap.end(), later);
+    const size_t shard = m_heap.back();
+    if (++m_cursors[shard].first == m_cursors[shard].second)
+      m_heap.pop_back();
+    else
+      std::push_heap(m_heap.begin(), m_heap.end(), later);
+  }
+} //namespace matan
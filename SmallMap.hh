@@ -0,0 +1,238 @@
+/*
+ * The little sibling of BigMap. BigMap keeps the values in their own vector
+ * so that the keys are packed tight, at the cost of a pointer chase to get
+ * from a key to its value. For values that are small and cheap to copy
+ * (ints, doubles, small structs) that extra cache miss costs more than the
+ * values would take up, so here everything lives in 1 vector of (K, V).
+ *
+ * The API is the same as BigMap's (minus deep sorting, since there is
+ * nothing to deep sort), so switching between them is just the type.
+ * Once the values get big, sorting and shifting has to move them too, and
+ * BigMap starts winning. See smallmap.cc for where the line is.
+ */
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <initializer_list>
+
+#include <boost/foreach.hpp>
+#include <boost/range/combine.hpp>
+
+#include "timsort.hh"
+#include "KeyScan.hh"
+#include "general.hh"
+
+namespace matan {
+  template <typename K, typename V>
+  class SmallMap {
+  public:
+    typedef std::pair<K, V> KV;
+    typedef typename std::vector<KV>::iterator iterator;
+    typedef typename std::vector<KV>::const_iterator const_iterator;
+    typedef typename std::vector<KV>::reverse_iterator reverse_iterator;
+    typedef typename std::vector<KV>::const_reverse_iterator const_reverse_iterator;
+
+  private:
+    std::vector<KV> m_kvs;
+    bool m_sorted = true;
+
+    size_t findIndex(const K& key) const; //m_kvs.size() if not found
+    iterator rawFind(const K& key) { return m_kvs.begin() + findIndex(key); }
+    const_iterator rawFind(const K& key) const { return m_kvs.begin() + findIndex(key); }
+
+    template <bool noReplace=false>
+    void rawAppend(const K& key, const V& val);
+    void rawAppend(const std::pair<const K, const V>& kv) { rawAppend(kv.first, kv.second); }
+
+    bool replace(const K& key, const V& val);
+
+    static bool lowerKeyComp(const KV& a, const K& b) { return a.first < b; };
+    static bool keyComp(const KV& a, const KV& b) { return a.first < b.first; };
+  public:
+    SmallMap() = default;
+    SmallMap(const int n) { m_kvs.reserve(n); }
+
+    template <typename Iter>
+    SmallMap(const Iter& pairs);
+
+    template <typename IterK, typename IterV>
+    SmallMap(const IterK& keys, const IterV& vals);
+
+    iterator begin() { return m_kvs.begin(); }
+    const_iterator begin() const { return m_kvs.begin(); }
+    iterator end() { return m_kvs.end(); }
+    const_iterator end() const { return m_kvs.end(); }
+    reverse_iterator rbegin() { return m_kvs.rbegin(); }
+    const_reverse_iterator rbegin() const  { return m_kvs.rbegin(); }
+    reverse_iterator rend() { return m_kvs.rend(); }
+    const_reverse_iterator rend() const { return m_kvs.rend(); }
+
+    size_t size() const { return m_kvs.size(); }
+    bool isSorted() const { return m_sorted; }
+    iterator find(const K& key) { return rawFind(key); }
+    const_iterator find(const K& key) const { return rawFind(key); }
+    V& operator[](const K& key);
+    void reserve(const int n) { m_kvs.reserve(n); }
+
+    void insert(const K& key, const V& val);
+    void insert(const std::pair<const K, const V>& kv) { insert(kv.first, kv.second); }
+
+    //See BigMap for append vs insert.
+    template <typename Iter>
+    void batchInsert(const Iter& pairs);
+    void batchInsert(const std::initializer_list<std::pair<K, V>>&& pairs);
+    template <typename IterK, typename IterV>
+    void batchInsert(const IterK& keys, const IterV& vals);
+
+    void append(const K& key, const V& val) { rawAppend(key, val); }
+    void append(const std::pair<K, V>& kv) { append(kv.first, kv.second); };
+
+    template <typename Iter>
+    void batchAppend(const Iter& pairs);
+    void batchAppend(const std::initializer_list<std::pair<K, V>>&& pairs);
+    template <typename IterK, typename IterV>
+    void batchAppend(const IterK& keys, const IterV& vals);
+
+    bool remove(const K& key);
+    void sort();
+  };
+
+  template <typename K, typename V>
+  template <typename Iter>
+  SmallMap<K, V>::SmallMap(const Iter& pairs) {
+    m_kvs.reserve(pairs.size());
+    batchInsert(pairs);
+  }
+
+  template <typename K, typename V>
+  template <typename IterK, typename IterV>
+  SmallMap<K, V>::SmallMap(const IterK& keys, const IterV& vals) {
+    m_kvs.reserve(keys.size());
+    batchInsert(keys, vals);
+  }
+
+  template <typename K, typename V>
+  V& SmallMap<K, V>::operator[](const K& key) {
+    iterator it = rawFind(key);
+    if (it != end())
+      return it->second;
+    if (m_sorted) {
+      insert(key, V());
+      return rawFind(key)->second;
+    }
+    rawAppend<true>(key, V());
+    return m_kvs.back().second;
+  }
+
+  template <typename K, typename V>
+  void SmallMap<K, V>::insert(const K& key, const V& val) {
+    if (replace(key, val)) {
+      if (!m_sorted)
+        sort();
+    } else if (!m_sorted) {
+      m_kvs.push_back(KV(key, val));
+      sort();
+    } else {
+      m_kvs.insert(std::lower_bound(m_kvs.begin(), m_kvs.end(), key, lowerKeyComp),
+                   KV(key, val));
+    }
+  }
+
+  template <typename K, typename V>
+  template <typename Iter>
+  void SmallMap<K, V>::batchInsert(const Iter& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+    sort();
+  }
+
+  template <typename K, typename V>
+  void SmallMap<K, V>::batchInsert(const std::initializer_list<std::pair<K, V>>&& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+    sort();
+  }
+
+  template <typename K, typename V>
+  template <typename IterK, typename IterV>
+  void SmallMap<K, V>::batchInsert(const IterK& keys, const IterV& vals) {
+    batchAppend(keys, vals);
+    sort();
+  }
+
+  template <typename K, typename V>
+  template <typename Iter>
+  void SmallMap<K, V>::batchAppend(const Iter& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+  }
+
+  template <typename K, typename V>
+  void SmallMap<K, V>::batchAppend(const std::initializer_list<std::pair<K, V>>&& pairs) {
+    for (const std::pair<K, V>& it : pairs) {
+      rawAppend(it);
+    }
+  }
+
+  template <typename K, typename V>
+  template <typename IterK, typename IterV>
+  void SmallMap<K, V>::batchAppend(const IterK& keys, const IterV& vals) {
+    BOOST_FOREACH(const auto kv, boost::combine(keys, vals)) {
+      rawAppend(boost::get<0>(kv), boost::get<1>(kv));
+    }
+  }
+
+  template <typename K, typename V>
+  bool SmallMap<K, V>::replace(const K& key, const V& val) {
+    iterator it = rawFind(key);
+    if (it == m_kvs.end())
+      return false;
+    it->second = val;
+    return true;
+  }
+
+  template <typename K, typename V>
+  template <bool noReplace>
+  void SmallMap<K, V>::rawAppend(const K& key, const V& val) {
+    if (!noReplace && replace(key, val))
+      return;
+    if (!m_kvs.empty() && !(m_kvs.back().first < key))
+      m_sorted = false;
+    m_kvs.push_back(KV(key, val));
+  }
+
+  template <typename K, typename V>
+  bool SmallMap<K, V>::remove(const K& key) {
+    iterator it = rawFind(key);
+    if (it == m_kvs.end())
+      return false;
+    if (m_sorted) {
+      m_kvs.erase(it);
+    } else {
+      *it = m_kvs.back();
+      m_kvs.pop_back();
+    }
+    return true;
+  }
+
+  template <typename K, typename V>
+  size_t SmallMap<K, V>::findIndex(const K& key) const {
+    const KV* first = m_kvs.data();
+    const KV* last = first + m_kvs.size();
+    if (m_sorted)
+      return findSortedKey(first, last, key) - first;
+    return scanKeys(first, last, key) - first;
+  }
+
+  template <typename K, typename V>
+  void SmallMap<K, V>::sort() {
+    matan::timsort(m_kvs.begin(), m_kvs.end(), keyComp);
+    m_sorted = true;
+  }
+} //namespace matan
@@ -38,13 +38,13 @@ namespace matan {
     void threadProc();
   };
 
-  ThreadPool::ThreadPool(int n) {
+  inline ThreadPool::ThreadPool(int n) {
     for (int i = 0; i < n; ++i) {
       m_workers.emplace_back([this](){this->threadProc();});
     }
   }
 
-  ThreadPool::~ThreadPool() {
+  inline ThreadPool::~ThreadPool() {
     std::unique_lock<std::mutex> lock(m_queueMutex);
     m_bStop = true;
     m_cvTask.notify_all();
@@ -88,7 +88,7 @@ namespace matan {
     return fut;
   }
   
-  void ThreadPool::waitFinished() {
+  inline void ThreadPool::waitFinished() {
     std::unique_lock<std::mutex> lock(m_queueMutex);
     m_cvFinished.wait(lock,
                       [this]() {
@@ -97,7 +97,7 @@ namespace matan {
     m_busy = 0;
   }
 
-  void ThreadPool::threadProc() {
+  inline void ThreadPool::threadProc() {
     while (true) {
       std::unique_lock<std::mutex> lock(m_queueMutex);
       m_cvTask.wait(lock, [this]() { return m_bStop || !m_tasks.empty(); });
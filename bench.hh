@@ -0,0 +1,40 @@
+/*
+ * What the drivers that time one map against another share. Their timings
+ * only mean anything built without the sanitizers, e.g.
+ *   make smallmap SANITIZER_FLAGS=
+ */
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <cstddef>
+#include "general.hh"
+
+namespace matan {
+
+//A value N bytes big, every word set to what it was made from.
+template <size_t N>
+struct Blob {
+  u64 words[N / sizeof(u64)];
+  Blob() = default;
+  Blob(u64 x) { std::fill(std::begin(words), std::end(words), x); }
+  u64 get() const { return words[0]; }
+};
+
+//Time since it was made or last lapped, in Unit.
+class Stopwatch {
+public:
+  template <typename Unit=std::chrono::microseconds>
+  long lap() {
+    const auto now = std::chrono::steady_clock::now();
+    const long elapsed = std::chrono::duration_cast<Unit>(now - m_last).count();
+    m_last = now;
+    return elapsed;
+  }
+
+private:
+  std::chrono::steady_clock::time_point m_last = std::chrono::steady_clock::now();
+};
+
+} // matan
@@ -3,6 +3,10 @@
 
 #include "iostream"
 
+#include <string_view>
+
+#include <boost/range/iterator_range.hpp>
+
 template<typename BigMap>
 void printBigMap(const BigMap& bigMap) {
   for (const auto& kv : bigMap) {
@@ -33,7 +37,213 @@ void bigMapTest(){
   std::cout << "remove 4: "; bigMap.remove(4); printBigMap(bigMap);
 }
 
+void searchIndexTest() {
+  matan::BigMap<int, std::string> bigMap;
+  bigMap.useSearchIndex();
+  bigMap.batchInsert({{5, "e"}, {3, "c"}, {8, "h"}, {1, "a"}, {9, "i"}, {2, "b"}});
+  printBigMap(bigMap);
+  for (int key : {0, 1, 4, 8, 9, 10}) {
+    auto it = bigMap.find(key);
+    std::cout << "find " << key << ": " << (it == bigMap.end() ? "-" : *it->second) << std::endl;
+  }
+}
+
+void indexHandlesTest() {
+  matan::BigMap<int, std::string, true, true> bigMap;
+  bigMap.batchAppend({{4, "d"}, {2, "b"}, {7, "g"}, {1, "a"}});
+  bigMap.sort();
+  std::cout << "remove 2: "; bigMap.remove(2);
+  for (const auto& kv : bigMap) {
+    std::cout << "(" << kv.first << "," << bigMap.value(kv) << ") ";
+  }
+  std::cout << std::endl;
+}
+
+void lazyRemoveTest() {
+  matan::BigMap<int, std::string> bigMap;
+  bigMap.lazyRemove(0.5);
+  bigMap.batchInsert({{1, "a"}, {2, "b"}, {3, "c"}, {4, "d"}, {5, "e"}, {6, "f"}});
+  bigMap.remove(2);
+  std::cout << "find 2: " << (bigMap.find(2) == bigMap.end() ? "-" : "found") << " size " << bigMap.size() << std::endl;
+  std::cout << "removeBatch 1 3 7: " << bigMap.removeBatch(std::vector<int>({1, 3, 7})) << std::endl;
+  printBigMap(bigMap);
+}
+
+void rangeTest() {
+  matan::BigMap<int, std::string> bigMap;
+  bigMap.batchAppend({{9, "i"}, {2, "b"}, {7, "g"}, {4, "d"}, {5, "e"}, {1, "a"}});
+  std::cout << "range [3, 8): ";
+  for (const auto& kv : bigMap.range(3, 8)) {
+    std::cout << "(" << kv.first << "," << kv.second << ") ";
+  }
+  std::cout << std::endl;
+  std::cout << "lower_bound 6: " << bigMap.lower_bound(6)->first
+            << " upper_bound 7: " << bigMap.upper_bound(7)->first
+            << " equal_range 3 is empty: " << (bigMap.equal_range(3).first == bigMap.equal_range(3).second)
+            << std::endl;
+  std::vector<matan::BigMap<int, std::string>::iterator> found;
+  std::cout << "findMany 9 3 1: " << bigMap.findMany(std::vector<int>({9, 3, 1}), found) << " found:";
+  for (auto it : found) {
+    std::cout << " " << (it == bigMap.end() ? "-" : *it->second);
+  }
+  std::cout << std::endl;
+}
+
+void parallelSortTest() {
+  matan::ThreadPool pool(4);
+  matan::BigMap<int, int> bigMap;
+  bigMap.useHashIndex();
+  for (int i = 0; i < 100000; i++) {
+    bigMap.append((i * 7919) % 100003, i);
+  }
+  bigMap.sort(pool);
+  bigMap.deepSort(pool);
+  std::cout << "parallel sort: sorted " << std::is_sorted(bigMap.begin(), bigMap.end())
+            << " deep sorted " << bigMap.isDeepSorted()
+            << " value of 7919: " << bigMap[7919] << std::endl;
+}
+
+void snapshotTest() {
+  matan::BigMap<int, double> bigMap;
+  bigMap.batchAppend({{3, 0.3}, {1, 0.1}, {2, 0.2}, {9, 0.9}});
+  bigMap.saveSnapshot("/tmp/bigmap.snapshot");
+  matan::MappedBigMap<int, double> mapped("/tmp/bigmap.snapshot");
+  std::cout << "mapped " << mapped.size() << ": ";
+  for (const auto& kv : mapped) {
+    std::cout << "(" << kv.first << "," << kv.second << ") ";
+  }
+  std::cout << "find 9: " << mapped.find(9).value()
+            << " find 4: " << (mapped.find(4) == mapped.end() ? "-" : "found") << std::endl;
+  std::remove("/tmp/bigmap.snapshot");
+}
+
+void setOpsTest() {
+  matan::BigMap<int, std::string> ours, theirs;
+  ours.batchInsert({{1, "a"}, {2, "b"}, {3, "c"}});
+  theirs.batchInsert({{2, "B"}, {3, "C"}, {4, "D"}});
+  matan::BigMap<int, std::string> merged;
+  merged.batchInsert({{1, "a"}, {5, "e"}});
+  std::cout << "mergeFrom: "; merged.mergeFrom(theirs); printBigMap(merged);
+  std::cout << "intersectWith keeping ours: "; ours.intersectWith(theirs, matan::MergePolicy::KeepOurs); printBigMap(ours);
+  std::cout << "subtract: "; theirs.subtract(ours); printBigMap(theirs);
+}
+
+void moveTest() {
+  matan::BigMap<int, std::string> bigMap;
+  std::string big(32, 'x');
+  bigMap.insert(1, std::move(big));
+  bigMap.emplace(2, 3, 'y'); //std::string(3, 'y') built in place
+  std::vector<std::pair<int, std::string>> pairs = {{3, "c"}, {0, "z"}};
+  bigMap.batchInsert(boost::make_iterator_range(std::make_move_iterator(pairs.begin()),
+                                                std::make_move_iterator(pairs.end())));
+  std::cout << "moved in: "; printBigMap(bigMap);
+}
+
+void arenaTest() {
+  std::pmr::monotonic_buffer_resource arena;
+  matan::pmr::BigMap<int, std::string> bigMap(&arena);
+  bigMap.batchInsert({{2, "b"}, {1, "a"}});
+  matan::pmr::BigMap<int, std::string> copy(bigMap); //default resource, but points at its own values
+  bigMap.remove(1);
+  std::cout << "arena: "; printBigMap(bigMap);
+  std::cout << "copy: "; printBigMap(copy);
+}
+
+void compareTest() {
+  //std::less<> is transparent, so lookups take a string_view as is.
+  matan::BigMap<std::string, int, true, false, std::less<>> bigMap;
+  bigMap.batchInsert({{"apple", 1}, {"banana", 2}, {"cherry", 3}});
+  const char buffer[] = "banana split";
+  const std::string_view banana(buffer, 6);
+  std::cout << "find(string_view): " << bigMap.value(*bigMap.find(banana)) << std::endl;
+  bigMap.remove(banana);
+  std::cout << "removed banana: "; printBigMap(bigMap);
+
+  matan::BigMap<int, std::string, true, false, std::greater<int>> descending;
+  descending.batchInsert({{1, "a"}, {3, "c"}, {2, "b"}});
+  std::cout << "greater: "; printBigMap(descending);
+}
+
+void interpolationTest() {
+  //Timestamps a second apart, give or take, so the guesses land close.
+  matan::BigMap<long, int> bigMap;
+  for (int i = 0; i < 1000; i++) {
+    bigMap.append(1500000000L + i * 1000 + (i * 7919) % 300, i);
+  }
+  bigMap.useInterpolation();
+  bigMap.sort();
+  const long key = 1500000000L + 500 * 1000 + (500 * 7919) % 300;
+  std::cout << "interpolation find: " << bigMap.value(*bigMap.find(key))
+            << " missing: " << (bigMap.find(key + 1) == bigMap.end())
+            << " lower_bound(key+1): " << bigMap.value(*bigMap.lower_bound(key + 1)) << std::endl;
+}
+
+void incrementalDeepSortTest() {
+  matan::BigMap<int, std::string> bigMap;
+  bigMap.incrementalDeepSort(1);
+  bigMap.batchAppend({{5, "e"}, {1, "a"}, {4, "d"}, {2, "b"}});
+  //m_vals fills up along the way, from then on each append moves 1 old value over.
+  bigMap.append(3, "c"); bigMap.append(6, "f");
+  std::cout << "incremental deepSort: "; printBigMap(bigMap);
+  bigMap.remove(4); //finishes the move first
+  std::cout << "remove 4: "; printBigMap(bigMap);
+}
+
+void zippedTest() {
+  matan::BigMap<int, int> bigMap;
+  bigMap.batchAppend({{3, 30}, {1, 10}, {2, 20}});
+  long sum = 0;
+  for (const auto& kv : bigMap.zipped()) { //sorts and deep sorts first
+    sum += kv.first * kv.second;
+  }
+  const auto zipped = bigMap.zipped();
+  std::for_each(zipped.begin(), zipped.end(), [](auto kv) { kv.second += 1; });
+  std::cout << "zipped sum: " << sum << " deep sorted: " << bigMap.isDeepSorted()
+            << " after for_each: "; printBigMap(bigMap);
+}
+
+void bloomFilterTest() {
+  matan::BigMap<int, std::string> bigMap;
+  bigMap.useBloomFilter();
+  bigMap.batchInsert({{1, "a"}, {2, "b"}});
+  bigMap.append(3, "c");
+  std::cout << "bloom filter find 3: " << bigMap.value(*bigMap.find(3))
+            << " find 4 missing: " << (bigMap.find(4) == bigMap.end()) << std::endl;
+}
+
+//Only counts when built with -DBIGMAP_STATS (make bigmap DEFINES=-DBIGMAP_STATS).
+void statsTest() {
+  matan::BigMap<int, int> bigMap;
+  bigMap.batchAppend({{3, 30}, {1, 10}, {2, 20}});
+  bigMap.find(2);
+  bigMap.insert(0, 0);
+  bigMap.remove(1);
+  const matan::bigmapstats::Stats stats = bigMap.stats();
+  std::cout << "stats:";
+  for (size_t i = 0; i < matan::bigmapstats::NUM_COUNTERS; i++) {
+    if (stats.counts[i] != 0)
+      std::cout << " " << matan::bigmapstats::NAMES[i] << "=" << stats.counts[i];
+  }
+  bigMap.resetStats();
+  std::cout << " after reset: " << bigMap.stats()[matan::bigmapstats::SORTS] << std::endl;
+}
+
 int main() {
   bigMapTest();
+  searchIndexTest();
+  indexHandlesTest();
+  lazyRemoveTest();
+  rangeTest();
+  parallelSortTest();
+  snapshotTest();
+  setOpsTest();
+  moveTest();
+  arenaTest();
+  compareTest();
+  interpolationTest();
+  incrementalDeepSortTest();
+  zippedTest();
+  statsTest();
+  bloomFilterTest();
   return EXIT_SUCCESS;
 }
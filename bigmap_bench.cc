@@ -0,0 +1,379 @@
+#include "BigMap.hh"
+#include "bench.hh"
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <cstdlib>
+
+/*
+ * Times BigMap against std::map, std::unordered_map and a sorted vector of
+ * pairs over a sweep of key counts, value sizes and insertion orders, and
+ * writes one CSV row per measurement to stdout (progress goes to stderr):
+ *
+ *   container,op,order,keys,value_bytes,ns_per_op
+ *
+ *   make bigmap_bench SANITIZER_FLAGS= && bin/bigmap_bench [maxKeys] [budgetMB] > results.csv
+ *
+ * maxKeys (default 100M) caps the sweep, and a run is skipped if its
+ * containers would take more than budgetMB (default 1024) of memory.
+ *
+ * ops:
+ *   append      n single key appends, then whatever makes the map sorted
+ *   insert      n single key inserts, keeping the map sorted the whole time
+ *   batchInsert build from a vector of all n pairs at once
+ *   findHit     n lookups of random keys that are there
+ *   findMiss    n lookups of random keys that aren't
+ *   range       n/100 ordered queries of the (up to) 100 keys from a random
+ *               key on, summing each key and value, per query
+ *   iterate     a pass over every key and value in order
+ *   remove      n/10 distinct random keys removed
+ *
+ * For std::map and std::unordered_map append and insert are the same
+ * emplace. Inserting into (or removing from) the middle of a sorted vector
+ * or a BigMap shifts everything after it, so those are only run up to
+ * SHIFT_MAX keys. BigMap appends with the hash index and removes lazily,
+ * the way it's meant to be used for those, and its remove includes the
+ * compact() that really drops them. Its ranges run on the map as
+ * batchInsert left it, values not deep sorted, so they show what the
+ * range iterator's prefetching buys. It iterates deep sorted, and deep
+ * sorts before the clock starts, since that's a one off the others don't
+ * have. std::unordered_map has no order, so no range.
+ */
+
+using matan::u64;
+using matan::Blob;
+
+constexpr size_t SHIFT_MAX = 100000;
+/*
+ * Small runs are repeated until they've done at least MIN_OPS ops, so the
+ * timings mean something, but no more than it takes to copy REP_BYTES of
+ * values, else big values at small n take minutes for no better a number.
+ */
+constexpr size_t MIN_OPS = 100000;
+constexpr size_t REP_BYTES = 64 << 20;
+constexpr size_t RANGE_KEYS = 100;
+
+template <typename V>
+struct BigMapBench {
+  static constexpr const char* NAME = "BigMap";
+  static constexpr bool ORDERED = true;
+  matan::BigMap<u64, V> map;
+
+  void append(u64 key, const V& val) {
+    if (map.size() == 0)
+      map.useHashIndex(); //else every append scans for the key
+    map.append(key, val);
+  }
+  void finishAppends() { map.sort(); map.useHashIndex(false); }
+  bool canShift(size_t n) const { return n <= SHIFT_MAX; }
+  void insert(u64 key, const V& val) { map.insert(key, val); }
+  void batchInsert(const std::vector<std::pair<u64, V>>& pairs) {
+    map.reserve(pairs.size());
+    map.useHashIndex();
+    map.batchInsert(pairs);
+    map.useHashIndex(false);
+  }
+  bool find(u64 key) { return map.find(key) != map.end(); }
+  u64 range(u64 lo, u64 hi) {
+    u64 sum = 0;
+    for (const auto& kv : map.range(lo, hi)) {
+      sum += kv.first + kv.second.words[0];
+    }
+    return sum;
+  }
+  void prepareIterate() { map.deepSort(); }
+  u64 iterate() {
+    u64 sum = 0;
+    for (const auto& kv : map.zipped()) {
+      sum += kv.first + kv.second.words[0];
+    }
+    return sum;
+  }
+  void prepareRemoves() { map.lazyRemove(0.25); }
+  void remove(u64 key) { map.remove(key); }
+  void finishRemoves() { map.compact(); }
+};
+
+template <typename V>
+struct StdMapBench {
+  static constexpr const char* NAME = "std::map";
+  static constexpr bool ORDERED = true;
+  std::map<u64, V> map;
+
+  void append(u64 key, const V& val) { map.emplace(key, val); }
+  void finishAppends() {}
+  bool canShift(size_t) const { return true; }
+  void insert(u64 key, const V& val) { map.emplace(key, val); }
+  void batchInsert(const std::vector<std::pair<u64, V>>& pairs) { map.insert(pairs.begin(), pairs.end()); }
+  bool find(u64 key) { return map.find(key) != map.end(); }
+  u64 range(u64 lo, u64 hi) {
+    u64 sum = 0;
+    for (auto it = map.lower_bound(lo), last = map.lower_bound(hi); it != last; ++it) {
+      sum += it->first + it->second.words[0];
+    }
+    return sum;
+  }
+  void prepareIterate() {}
+  u64 iterate() {
+    u64 sum = 0;
+    for (const auto& kv : map) {
+      sum += kv.first + kv.second.words[0];
+    }
+    return sum;
+  }
+  void prepareRemoves() {}
+  void remove(u64 key) { map.erase(key); }
+  void finishRemoves() {}
+};
+
+//Unordered, so iterate is a pass in whatever order it keeps them.
+template <typename V>
+struct UnorderedMapBench {
+  static constexpr const char* NAME = "std::unordered_map";
+  static constexpr bool ORDERED = false;
+  std::unordered_map<u64, V> map;
+
+  void append(u64 key, const V& val) { map.emplace(key, val); }
+  void finishAppends() {}
+  bool canShift(size_t) const { return true; }
+  void insert(u64 key, const V& val) { map.emplace(key, val); }
+  void batchInsert(const std::vector<std::pair<u64, V>>& pairs) {
+    map.reserve(pairs.size());
+    map.insert(pairs.begin(), pairs.end());
+  }
+  bool find(u64 key) { return map.find(key) != map.end(); }
+  void prepareIterate() {}
+  u64 iterate() {
+    u64 sum = 0;
+    for (const auto& kv : map) {
+      sum += kv.first + kv.second.words[0];
+    }
+    return sum;
+  }
+  void prepareRemoves() {}
+  void remove(u64 key) { map.erase(key); }
+  void finishRemoves() {}
+};
+
+//The flat map baseline, keys and values side by side in 1 sorted array.
+template <typename V>
+struct SortedVectorBench {
+  static constexpr const char* NAME = "sorted_vector";
+  static constexpr bool ORDERED = true;
+  typedef std::pair<u64, V> KV;
+  std::vector<KV> pairs;
+
+  static bool less(const KV& kv, u64 key) { return kv.first < key; }
+  void append(u64 key, const V& val) { pairs.emplace_back(key, val); }
+  void finishAppends() {
+    std::sort(pairs.begin(), pairs.end(), [](const KV& a, const KV& b) { return a.first < b.first; });
+  }
+  bool canShift(size_t n) const { return n <= SHIFT_MAX; }
+  void insert(u64 key, const V& val) {
+    const auto it = std::lower_bound(pairs.begin(), pairs.end(), key, less);
+    if (it != pairs.end() && it->first == key)
+      it->second = val;
+    else
+      pairs.emplace(it, key, val);
+  }
+  void batchInsert(const std::vector<KV>& kvs) {
+    pairs = kvs;
+    finishAppends();
+  }
+  bool find(u64 key) {
+    const auto it = std::lower_bound(pairs.begin(), pairs.end(), key, less);
+    return it != pairs.end() && it->first == key;
+  }
+  u64 range(u64 lo, u64 hi) {
+    u64 sum = 0;
+    const auto last = std::lower_bound(pairs.begin(), pairs.end(), hi, less);
+    for (auto it = std::lower_bound(pairs.begin(), last, lo, less); it != last; ++it) {
+      sum += it->first + it->second.words[0];
+    }
+    return sum;
+  }
+  void prepareIterate() {}
+  u64 iterate() {
+    u64 sum = 0;
+    for (const KV& kv : pairs) {
+      sum += kv.first + kv.second.words[0];
+    }
+    return sum;
+  }
+  void prepareRemoves() {}
+  void remove(u64 key) {
+    const auto it = std::lower_bound(pairs.begin(), pairs.end(), key, less);
+    if (it != pairs.end() && it->first == key)
+      pairs.erase(it);
+  }
+  void finishRemoves() {}
+};
+
+enum class Order { Sorted, Reversed, Random };
+const char* orderName(Order order) {
+  return order == Order::Sorted ? "sorted" : order == Order::Reversed ? "reversed" : "random";
+}
+
+//Keys are even, so odd keys are the misses.
+std::vector<u64> makeKeys(size_t n, Order order, std::mt19937_64& rng) {
+  std::vector<u64> keys(n);
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = 2 * i;
+  }
+  if (order == Order::Reversed)
+    std::reverse(keys.begin(), keys.end());
+  else if (order == Order::Random)
+    std::shuffle(keys.begin(), keys.end(), rng);
+  return keys;
+}
+
+u64 g_sink = 0; //so the optimizer can't drop the work
+
+template <typename V>
+void report(const char* container, const char* op, Order order, size_t n, double ns, size_t ops) {
+  std::cout << container << "," << op << "," << orderName(order) << "," << n << ","
+            << sizeof(V) << "," << ns / ops << std::endl;
+}
+
+/*
+ * Runs every op on a fresh Bench for each repetition, and reports the mean
+ * time per op. The finds, iterate and remove run on the map batchInsert built.
+ * queries are keys to find, removals distinct keys to remove.
+ */
+template <template <typename> class Bench, typename V>
+void benchContainer(const std::vector<u64>& keys, const std::vector<u64>& queries,
+                    const std::vector<u64>& removals, Order order) {
+  typedef Bench<V> B;
+  const size_t n = keys.size();
+  const size_t reps = std::max<size_t>(1, std::min(MIN_OPS / n, REP_BYTES / (n * sizeof(V))));
+  const size_t ranges = n / RANGE_KEYS;
+  std::vector<std::pair<u64, V>> pairs;
+  pairs.reserve(n);
+  for (u64 key : keys) {
+    pairs.emplace_back(key, V(key));
+  }
+  matan::Stopwatch watch;
+  const auto nanos = [&watch]() { return double(watch.lap<std::chrono::nanoseconds>()); };
+
+  double appendNs = 0, insertNs = 0, batchNs = 0, hitNs = 0, missNs = 0, rangeNs = 0, iterateNs = 0, removeNs = 0;
+  const bool shift = B().canShift(n);
+  for (size_t rep = 0; rep < reps; rep++) {
+    {
+      B bench;
+      watch.lap();
+      for (const auto& kv : pairs) {
+        bench.append(kv.first, kv.second);
+      }
+      bench.finishAppends();
+      appendNs += nanos();
+    }
+    if (shift) {
+      B bench;
+      watch.lap();
+      for (const auto& kv : pairs) {
+        bench.insert(kv.first, kv.second);
+      }
+      insertNs += nanos();
+    }
+
+    B bench;
+    watch.lap();
+    bench.batchInsert(pairs);
+    batchNs += nanos();
+
+    watch.lap();
+    for (u64 query : queries) {
+      g_sink += bench.find(query);
+    }
+    hitNs += nanos();
+    watch.lap();
+    for (u64 query : queries) {
+      g_sink += bench.find(query + 1);
+    }
+    missNs += nanos();
+
+    if constexpr (B::ORDERED) {
+      watch.lap();
+      //Keys are 2 apart.
+      for (size_t i = 0; i < ranges; i++) {
+        g_sink += bench.range(queries[i], queries[i] + 2 * RANGE_KEYS);
+      }
+      rangeNs += nanos();
+    }
+
+    bench.prepareIterate();
+    watch.lap();
+    g_sink += bench.iterate();
+    iterateNs += nanos();
+
+    if (shift || std::is_same<B, BigMapBench<V>>::value) {
+      bench.prepareRemoves();
+      watch.lap();
+      for (u64 key : removals) {
+        bench.remove(key);
+      }
+      bench.finishRemoves();
+      removeNs += nanos();
+    }
+  }
+
+  report<V>(B::NAME, "append", order, n, appendNs, reps * n);
+  if (shift)
+    report<V>(B::NAME, "insert", order, n, insertNs, reps * n);
+  report<V>(B::NAME, "batchInsert", order, n, batchNs, reps * n);
+  report<V>(B::NAME, "findHit", order, n, hitNs, reps * queries.size());
+  report<V>(B::NAME, "findMiss", order, n, missNs, reps * queries.size());
+  if (B::ORDERED && ranges != 0)
+    report<V>(B::NAME, "range", order, n, rangeNs, reps * ranges);
+  report<V>(B::NAME, "iterate", order, n, iterateNs, reps * n);
+  if (n >= 10 && (shift || std::is_same<B, BigMapBench<V>>::value))
+    report<V>(B::NAME, "remove", order, n, removeNs, reps * removals.size());
+}
+
+template <typename V>
+void benchValueSize(size_t maxKeys, size_t budgetBytes, std::mt19937_64& rng) {
+  for (size_t n = 1000; n <= maxKeys; n *= 10) {
+    /*
+     * Roughly the most any one run holds at once: the pairs to load from,
+     * the map, and the copy std::map and friends keep per node.
+     */
+    if (3 * n * (sizeof(u64) + sizeof(V) + 32) > budgetBytes) {
+      std::cerr << "skipping " << n << " keys of " << sizeof(V) << " bytes, over budget" << std::endl;
+      continue;
+    }
+    for (Order order : {Order::Sorted, Order::Reversed, Order::Random}) {
+      std::cerr << n << " keys, " << sizeof(V) << " byte values, " << orderName(order) << std::endl;
+      const std::vector<u64> keys = makeKeys(n, order, rng);
+      std::vector<u64> queries(n);
+      for (u64& query : queries) {
+        query = keys[rng() % n];
+      }
+      std::vector<u64> removals = keys;
+      std::shuffle(removals.begin(), removals.end(), rng);
+      removals.resize(n / 10);
+      benchContainer<BigMapBench, V>(keys, queries, removals, order);
+      benchContainer<StdMapBench, V>(keys, queries, removals, order);
+      benchContainer<UnorderedMapBench, V>(keys, queries, removals, order);
+      benchContainer<SortedVectorBench, V>(keys, queries, removals, order);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  const size_t maxKeys = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000000;
+  const size_t budgetBytes = (argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1024) << 20;
+  std::mt19937_64 rng(42);
+
+  std::cout << "container,op,order,keys,value_bytes,ns_per_op" << std::endl;
+  benchValueSize<Blob<8>>(maxKeys, budgetBytes, rng);
+  benchValueSize<Blob<64>>(maxKeys, budgetBytes, rng);
+  benchValueSize<Blob<512>>(maxKeys, budgetBytes, rng);
+  benchValueSize<Blob<4096>>(maxKeys, budgetBytes, rng);
+  std::cerr << "(" << g_sink << ")" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#include "ConcurrentBigMap.hh"
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+/*
+ * The writer publishes a version per key it adds, and keeps key 0 holding
+ * the last key added. Readers check that every snapshot they pin is
+ * consistent with itself, no matter how far the writer has gotten since.
+ */
+int main() {
+  matan::ConcurrentBigMap<long, long> concurrentMap;
+  std::atomic<bool> done(false);
+  std::atomic<long> inconsistent(0);
+  std::atomic<long> snapshots(0);
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.emplace_back([&]() {
+        auto reader = concurrentMap.reader();
+        while (!done) {
+          auto snapshot = reader.snapshot();
+          const long size = snapshot.size();
+          if (size == 0)
+            continue;
+          const long* last = snapshot.find(0);
+          const auto range = snapshot.range(1, size);
+          if (last == nullptr || *last != size - 1 || snapshot.find(size) != nullptr ||
+              range.second.base() - range.first.base() != size - 1)
+            ++inconsistent;
+          ++snapshots;
+        }
+      });
+  }
+
+  for (long key = 0; key < 2000; key++) {
+    concurrentMap.append(key, key);
+    concurrentMap.append(0, key);
+    concurrentMap.publish();
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  std::cout << "snapshots " << snapshots << " inconsistent " << inconsistent << std::endl;
+  return EXIT_SUCCESS;
+}
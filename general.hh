@@ -1,6 +1,7 @@
     #pragma once
     
     #include <stdint.h>
+    #include <utility>
     
     #define likely(x)    __builtin_expect (!!(x), 1)
     #define unlikely(x)  __builtin_expect (!!(x), 0)
@@ -16,15 +17,23 @@
     typedef uint32_t u32;
     typedef uint64_t u64;
     
+    /*
+     * std::hash is the identity for integers, so keys with a common stride
+     * (ids, timestamps, ...) would all land in the same few buckets. This
+     * spreads them out (fibonacci hashing), and the high bits are the best
+     * mixed, so take whatever bits are needed from the top.
+     */
+    inline u64 scrambleHash(u64 hash) { return hash * 0x9E3779B97F4A7C15ull; }
+    
     template <typename T, typename... Args>
     inline void place(T* loc, Args&&... args) {
-      ::new (loc) T(args...);
+      ::new (loc) T(std::forward<Args>(args)...);
     }
     
     template <typename T, typename... Args>
     inline void replace(T* p, Args&&... args) {
       p->~T();
-      ::new (p) T(args...);
+      ::new (p) T(std::forward<Args>(args)...);
     }
     
     } // matan
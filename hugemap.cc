@@ -0,0 +1,91 @@
+#include "HugeMap.hh"
+#include "BigMap.hh"
+#include "bench.hh"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+
+using matan::Blob;
+
+template<typename Map>
+void printHugeMap(const Map& hugeMap) {
+  for (const auto& kv : hugeMap) {
+    std::cout << "(" << kv.first << "," << hugeMap.value(kv) << ") ";
+  }
+  std::cout << std::endl;
+}
+
+void hugeMapTest() {
+  matan::HugeMap<int, std::string> hugeMap;
+  hugeMap.append(2, "two"); printHugeMap(hugeMap);
+  hugeMap.append({4, "four"}); printHugeMap(hugeMap);
+  hugeMap.batchAppend(std::vector<int>({26, 6}), std::vector<std::string>({"twenty six", "six"})); printHugeMap(hugeMap);
+  hugeMap.batchInsert({{7, "seven"}, {8, "eight"}, {1, "one"}}); printHugeMap(hugeMap);
+  const std::string* eight = &hugeMap.value(*hugeMap.find(8));
+  std::cout << "remove 7: "; hugeMap.remove(7); printHugeMap(hugeMap);
+  hugeMap.insert(3, "three"); printHugeMap(hugeMap);
+  hugeMap[5] = "five"; printHugeMap(hugeMap);
+  std::cout << "8 didn't move: " << (eight == &hugeMap.value(*hugeMap.find(8)))
+            << " " << *eight << std::endl;
+  matan::HugeMap<int, std::string> copy = hugeMap;
+  copy[5] = "cinco";
+  std::cout << "copy: "; printHugeMap(copy);
+}
+
+/*
+ * Grow to n keys in random order, then churn: remove a random key and
+ * insert a new one n times. This is the pattern that has BigMap copying
+ * values around on every reallocation and remove.
+ */
+template <typename Map>
+void timeMap(const char* name, const std::vector<long>& keys) {
+  const size_t n = keys.size() / 2;
+  matan::Stopwatch watch;
+  Map map;
+  for (size_t i = 0; i < n; i++) {
+    map.insert(keys[i], keys[i]);
+  }
+  const long insertUs = watch.lap();
+
+  for (size_t i = 0; i < n; i++) {
+    map.remove(keys[i]);
+    map.insert(keys[n+i], keys[n+i]);
+  }
+  const long churnUs = watch.lap();
+
+  long sum = 0;
+  for (long key : keys) {
+    auto it = map.find(key);
+    if (it != map.end())
+      sum += map.value(*it).get();
+  }
+  const long findUs = watch.lap();
+
+  std::cout << name << " insert " << insertUs << "us churn " << churnUs << "us find "
+            << findUs << "us (" << sum << ")" << std::endl;
+}
+
+template <typename V>
+void compare(const char* valName, size_t n) {
+  std::mt19937 rng(n);
+  std::vector<long> keys(2 * n);
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys[i] = long(i);
+  }
+  std::shuffle(keys.begin(), keys.end(), rng);
+
+  std::cout << "n=" << n << " V=" << valName << std::endl;
+  timeMap<matan::HugeMap<long, V>>("  HugeMap", keys);
+  timeMap<matan::BigMap<long, V>>("  BigMap ", keys);
+}
+
+int main() {
+  hugeMapTest();
+  for (size_t n : {1000, 10000}) {
+    compare<Blob<256>>("256B", n);
+    compare<Blob<4096>>("4KB", n);
+  }
+  return EXIT_SUCCESS;
+}
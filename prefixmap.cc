@@ -0,0 +1,104 @@
+#include "PrefixMap.hh"
+#include "BigMap.hh"
+#include "bench.hh"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+
+template <typename Map>
+void printPrefixMap(Map& prefixMap) {
+  for (const auto& kv : prefixMap) {
+    std::cout << "(" << kv.first << "," << kv.second << ") ";
+  }
+  std::cout << std::endl;
+}
+
+void prefixMapTest() {
+  matan::PrefixMap<int, 2> prefixMap;
+  prefixMap.batchInsert({{"/usr/lib/libc.so", 1}, {"/usr/lib/libm.so", 2}, {"/usr/bin/ls", 3}});
+  printPrefixMap(prefixMap);
+  prefixMap.insert("/usr/lib/libz.so", 4);
+  std::cout << "pending until sort: " << prefixMap.isSorted() << " "; printPrefixMap(prefixMap);
+  const char buffer[] = "/usr/lib/libm.so.6";
+  std::cout << "find libm.so: " << *prefixMap.find(std::string_view(buffer, 16)) << std::endl;
+  std::cout << "remove ls: "; prefixMap.remove("/usr/bin/ls"); printPrefixMap(prefixMap);
+  std::cout << "range [/usr/lib/libd, /usr/lib/libz): ";
+  for (const auto& kv : prefixMap.range("/usr/lib/libd", "/usr/lib/libz")) {
+    std::cout << "(" << kv.first << "," << kv.second << ") ";
+  }
+  std::cout << std::endl;
+}
+
+//Sort of like a source tree, lots of keys sharing long prefixes.
+std::vector<std::string> makePaths(size_t n, std::mt19937& rng) {
+  const char* roots[] = {"/home/build/workspace/project/src/", "/home/build/workspace/project/include/",
+                         "/usr/local/lib/python3/site-packages/"};
+  std::vector<std::string> paths;
+  paths.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    std::string path = roots[rng() % 3];
+    path += "module" + std::to_string(rng() % 64) + "/component" + std::to_string(rng() % 256) + "/";
+    path += "file" + std::to_string(i) + ".cc";
+    paths.push_back(std::move(path));
+  }
+  return paths;
+}
+
+//Heap bytes a std::string key takes on top of sizeof, past the small string buffer.
+size_t heapBytes(const std::string& key) { return key.capacity() > 15 ? key.capacity() + 1 : 0; }
+
+//Build and find times, and the bytes the keys take, for PrefixMap and BigMap on the same paths.
+void compare(size_t n) {
+  std::mt19937 rng(n);
+  const std::vector<std::string> paths = makePaths(n, rng);
+  std::vector<std::pair<std::string, long>> pairs;
+  for (size_t i = 0; i < n; i++) {
+    pairs.emplace_back(paths[i], long(i));
+  }
+  //Queries come in as views into some other buffer, so BigMap gets std::less<> to take them as is.
+  std::vector<std::string> queries;
+  for (size_t i = 0; i < n; i++) {
+    queries.push_back(paths[rng() % n]);
+  }
+
+  matan::Stopwatch watch;
+  matan::PrefixMap<long> prefixMap(pairs);
+  long buildMs = watch.lap<std::chrono::milliseconds>();
+  long sum = 0;
+  for (const std::string& query : queries) {
+    sum += *prefixMap.find(std::string_view(query));
+  }
+  long findMs = watch.lap<std::chrono::milliseconds>();
+  std::cout << "n=" << n << std::endl;
+  std::cout << "  PrefixMap build " << buildMs << "ms find " << findMs << "ms"
+            << " key bytes " << prefixMap.keyBytes() << " (" << sum << ")" << std::endl;
+
+  watch.lap();
+  matan::BigMap<std::string, long, true, false, std::less<>> bigMap;
+  bigMap.reserve(n);
+  bigMap.useHashIndex(); //else every append scans for the key
+  bigMap.batchInsert(pairs);
+  buildMs = watch.lap<std::chrono::milliseconds>();
+  sum = 0;
+  for (const std::string& query : queries) {
+    sum += bigMap.value(*bigMap.find(std::string_view(query)));
+  }
+  findMs = watch.lap<std::chrono::milliseconds>();
+  size_t bytes = n * sizeof(decltype(bigMap)::KV);
+  for (const auto& kv : bigMap) {
+    bytes += heapBytes(kv.first);
+  }
+  std::cout << "  BigMap    build " << buildMs << "ms find " << findMs << "ms"
+            << " key bytes " << bytes << " (" << sum << ")" << std::endl;
+}
+
+int main() {
+  prefixMapTest();
+  for (size_t n : {10000, 1000000}) {
+    compare(n);
+  }
+  return EXIT_SUCCESS;
+}
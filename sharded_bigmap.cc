@@ -0,0 +1,83 @@
+#include "ShardedBigMap.hh"
+#include "BigMap.hh"
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <random>
+#include <chrono>
+
+using namespace std::chrono;
+
+/*
+ * Several threads insert and remove at once, then a bulk load on the
+ * ThreadPool, then check that ordered() walks every key exactly once, in
+ * order, with the same values as a single BigMap given the same writes.
+ */
+int main() {
+  matan::ShardedBigMap<long, long> shardedMap;
+
+  std::vector<std::thread> writers;
+  for (long t = 0; t < 4; t++) {
+    writers.emplace_back([&shardedMap, t]() {
+        for (long i = 0; i < 10000; i++) {
+          shardedMap.append(i * 4 + t, i);
+          if (i % 10 == 0)
+            shardedMap.remove(i * 4 + t);
+        }
+      });
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  std::cout << "after writers: " << shardedMap.size() << std::endl;
+
+  std::mt19937 rng(5);
+  std::vector<std::pair<long, long>> pairs;
+  for (long i = 0; i < 200000; i++) {
+    pairs.emplace_back(long(rng() % 1000000) + 40000, i);
+  }
+  matan::ThreadPool pool(4);
+  auto start = high_resolution_clock::now();
+  shardedMap.batchInsert(pairs, pool);
+  auto loaded = high_resolution_clock::now();
+  std::cout << "batchInsert " << duration_cast<microseconds>(loaded-start).count()
+            << "us, size " << shardedMap.size() << std::endl;
+
+  long val = 0;
+  shardedMap.find(pairs.back().first, val);
+  shardedMap.visit(pairs.back().first, [](long& v) { v = -v; });
+  std::cout << "find " << pairs.back().first << ": " << val;
+  shardedMap.find(pairs.back().first, val);
+  std::cout << " negated: " << val << std::endl;
+
+  matan::BigMap<long, long> bigMap;
+  bigMap.useHashIndex();
+  for (long t = 0; t < 4; t++) {
+    for (long i = 0; i < 10000; i++) {
+      bigMap.append(i * 4 + t, i);
+      if (i % 10 == 0)
+        bigMap.remove(i * 4 + t);
+    }
+  }
+  bigMap.batchAppend(pairs);
+  bigMap.sort();
+  long& negated = bigMap.value(*bigMap.find(pairs.back().first));
+  negated = -negated;
+
+  size_t count = 0;
+  bool ordered = true;
+  bool same = true;
+  long prev = -1;
+  for (const auto& kv : shardedMap.ordered()) {
+    ordered = ordered && prev < kv.first;
+    prev = kv.first;
+    const auto it = bigMap.find(kv.first);
+    same = same && it != bigMap.end() && bigMap.value(*it) == kv.second;
+    ++count;
+  }
+  same = same && count == bigMap.size();
+  std::cout << "ordered: " << ordered << " walked " << count
+            << " same as BigMap: " << same << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include "SmallMap.hh"
+#include "BigMap.hh"
+#include "bench.hh"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+
+using matan::Blob;
+
+template<typename Map>
+void printSmallMap(const Map& smallMap) {
+  for (const auto& kv : smallMap) {
+    std::cout << "(" << kv.first << "," << kv.second << ") ";
+  }
+  std::cout << std::endl;
+}
+
+void smallMapTest() {
+  matan::SmallMap<int, double> smallMap;
+  smallMap.append(2, 0.2); printSmallMap(smallMap);
+  smallMap.append({4, 0.4}); printSmallMap(smallMap);
+  smallMap.batchAppend(std::vector<int>({26, 6}), std::vector<double>({2.6, 0.6})); printSmallMap(smallMap);
+  smallMap.batchInsert({{7, 0.7}, {8, 0.8}, {1, 0.1}}); printSmallMap(smallMap);
+  std::cout << "remove 7: "; smallMap.remove(7); printSmallMap(smallMap);
+  smallMap.insert(3, 0.3); printSmallMap(smallMap);
+  smallMap[5] = 0.5; printSmallMap(smallMap);
+  std::cout << "find 8: " << smallMap.find(8)->second << std::endl;
+}
+
+long get(long v) { return v; }
+template <size_t N>
+long get(const Blob<N>& b) { return b.get(); }
+
+//SmallMap iterators hold the value, BigMap ones point to it.
+template <typename T>
+const T& deref(const T& val) { return val; }
+template <typename T>
+const T& deref(T* pval) { return *pval; }
+
+template <typename Map>
+void timeMap(const char* name, const std::vector<std::pair<long, long>>& pairs,
+             const std::vector<long>& queries) {
+  matan::Stopwatch watch;
+  Map map;
+  map.reserve(pairs.size());
+  for (const auto& kv : pairs) {
+    map.insert(kv.first, kv.second);
+  }
+  const long insertUs = watch.lap();
+
+  long sum = 0;
+  for (long key : queries) {
+    auto it = map.find(key);
+    if (it != map.end())
+      sum += get(deref(it->second));
+  }
+  const long findUs = watch.lap();
+
+  for (const auto& kv : map) {
+    sum += get(deref(kv.second));
+  }
+  const long iterateUs = watch.lap();
+
+  std::cout << name << " insert " << insertUs << "us find " << findUs << "us iterate "
+            << iterateUs << "us (" << sum << ")" << std::endl;
+}
+
+template <typename V>
+void compare(const char* valName, size_t n) {
+  std::mt19937 rng(n);
+  std::vector<std::pair<long, long>> pairs;
+  pairs.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    pairs.emplace_back(long(i) * 2, long(i));
+  }
+  std::shuffle(pairs.begin(), pairs.end(), rng);
+  std::vector<long> queries;
+  for (size_t i = 0; i < n; i++) {
+    queries.push_back(long(rng() % (2 * n)));
+  }
+
+  std::cout << "n=" << n << " V=" << valName << std::endl;
+  timeMap<matan::SmallMap<long, V>>("  SmallMap", pairs, queries);
+  timeMap<matan::BigMap<long, V>>("  BigMap  ", pairs, queries);
+}
+
+/*
+ * Small values should favour SmallMap on find and iterate, since there is
+ * no pointer to chase. Big values should favour BigMap on insert, since
+ * only the (K, V*) pairs get shifted over.
+ */
+int main() {
+  smallMapTest();
+  for (size_t n : {1000, 10000}) {
+    compare<long>("long", n);
+    compare<Blob<64>>("64B", n);
+    compare<Blob<256>>("256B", n);
+  }
+  return EXIT_SUCCESS;
+}